@@ -16,6 +16,10 @@ int main(int argc, char* argv[]) {
     io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
     io61_file* outf = io61_open_check(args.output_file,
                                       O_WRONLY | O_CREAT | O_TRUNC);
+    // Holes in the input stay holes in the output
+    if (io61_hasholes(inf)) {
+        io61_setsparse(outf, 1);
+    }
 
     // Copy file data
     while (true) {
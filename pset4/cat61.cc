@@ -1,27 +1,41 @@
 #include "io61.hh"
 
-// Usage: ./cat61 [-s SIZE] [-o OUTFILE] [FILE]
+// Usage: ./cat61 [-s SIZE] [-o OUTFILE] [FILE...]
 //    Copies the input FILE to OUTFILE one character at a time.
+//    Several FILEs are concatenated with io61_gather.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_arguments args(argc, argv, "s:o:i:");
+    io61_arguments args(argc, argv, "s:o:i:#");
 
     io61_profile_begin();
-    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    std::vector<io61_file*> infs;
+    for (auto filename : args.input_files) {
+        infs.push_back(io61_open_check(filename, O_RDONLY));
+    }
     io61_file* outf = io61_open_check(args.output_file,
                                       O_WRONLY | O_CREAT | O_TRUNC);
+    // Holes in the input stay holes in the output
+    if (infs.size() == 1 && io61_hasholes(infs[0])) {
+        io61_setsparse(outf, 1);
+    }
 
-    while (args.input_size > 0) {
-        int ch = io61_readc(inf);
-        if (ch == EOF) {
-            break;
+    if (infs.size() > 1) {
+        io61_gather(outf, infs.data(), infs.size(), args.input_size);
+    } else {
+        while (args.input_size > 0) {
+            int ch = io61_readc(infs[0]);
+            if (ch == EOF) {
+                break;
+            }
+            io61_writec(outf, ch);
+            --args.input_size;
         }
-        io61_writec(outf, ch);
-        --args.input_size;
     }
 
-    io61_close(inf);
+    for (auto f : infs) {
+        io61_close(f);
+    }
     io61_close(outf);
     io61_profile_end();
 }
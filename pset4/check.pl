@@ -942,6 +942,65 @@ enqueue(31,
     "redirected large file, 1B-4KB block I/O, sequential");
 
 
+# READ/WRITE FILES
+
+enqueue(32,
+    "./patchcat61 -o files/out.txt files/text5meg.txt",
+    "read/write medium file, 4KB block I/O, random patch order");
+
+enqueue(33,
+    "./patchcat61 -b 1000 -r 6582 -o files/out.txt files/text5meg.txt",
+    "read/write medium file, 1000B block I/O, random patch order");
+
+
+# LINE I/O
+
+enqueue(34,
+    "./linerev61 -o files/out.txt files/text5meg.txt",
+    "regular medium file, line I/O, sequential");
+
+enqueue(35,
+    "cat files/text20meg.txt | ./linerev61 | cat > files/out.txt",
+    "piped large file, line I/O, sequential");
+
+enqueue(36,
+    "./linerev61 -o files/out.bin files/binary1meg.bin",
+    "regular small binary file, long-line I/O, sequential");
+
+
+# THREAD-SAFE FILES
+
+enqueue(37,
+    "./sharedcat61 -o files/out.txt files/text5meg.txt",
+    "shared medium file, 4KB block I/O, 4 writer threads");
+
+enqueue(38,
+    "./sharedcat61 -b 100 -o files/out.txt files/text1meg.txt",
+    "shared small file, 100B block I/O, 4 writer threads");
+
+
+# COMPRESSED FILES
+
+enqueue(39,
+    "./zcat61 -o files/out.txt files/text20meg.txt",
+    "compressed large file, 4KB block I/O, reverse order");
+
+enqueue(40,
+    "./zcat61 -b 100000 -o files/out.bin files/binary1meg.bin",
+    "compressed small binary file, 100KB block I/O, reverse order");
+
+
+# POSITIONED I/O
+
+enqueue(41,
+    "./preadcat61 -o files/out.txt files/text20meg.txt",
+    "positioned large file, 4KB block I/O, random order, 4 threads");
+
+enqueue(42,
+    "./preadcat61 -b 1000 -r 6582 -o files/out.txt files/text5meg.txt",
+    "positioned medium file, 1000B block I/O, random order, 4 threads");
+
+
 run($sequentially);
 
 summary();
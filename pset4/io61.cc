@@ -1,170 +1,4193 @@
 #include "io61.hh"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
 #include <climits>
+#include <cstddef>
+#include <cstdint>
 #include <cerrno>
 #include <algorithm>
+#include <atomic>
+#include <map>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <mutex>
+#include <condition_variable>
 
 
 // io61.cc
 //    YOUR CODE HERE!
 
 
+// io61_slot
+//    One block of the read cache, or one page of a read/write file's
+//    page cache. An empty slot has `tag == -1`.
+
+struct io61_slot {
+    unsigned char* buf;
+    off_t tag = -1;             // file offset of first byte in `buf`
+    off_t end_tag = -1;         // file offset after last valid byte
+    unsigned long lru = 0;      // last use time; smallest is evicted first
+    bool dirty = false;         // written since last written back
+    bool filling = false;       // io61_pread is reading it, unlocked
+};
+
+// Default cache geometry: 64 slots of 4096 bytes, 4 slots per set.
+// A miss reads up to `io61_cache_readahead` blocks in the predicted
+// direction.
+static constexpr size_t io61_cache_slots = 64;
+static constexpr size_t io61_cache_assoc = 4;
+static constexpr size_t io61_cache_readahead = 4;
+
+
+// io61_pattern
+//    Access patterns recognized from the seek history.
+
+enum io61_pattern {
+    io61_random,                // no pattern: keep default behavior
+    io61_forward,               // sequential, increasing offsets
+    io61_backward,              // short steps toward the start of file
+    io61_strided                // constant positive step between seeks
+};
+
+
+// io61_abuf, io61_async
+//    Asynchronous mode: a helper thread reads ahead into, or writes
+//    behind from, a ring of buffers. The application owns buffer `cur`.
+//
+//    Reading: the `ready` buffers after `cur` hold data read ahead; the
+//    thread reads into the buffer after those, at most `depth` buffers
+//    ahead. Other buffers keep their old contents, so seeking back to
+//    recent data is free. A buffer being read has `tag == -1`. Every
+//    seek that restarts readahead changes `gen`, so a read in flight
+//    during the seek is thrown away.
+//
+//    Writing: the `ready` buffers before `cur` are full and waiting to
+//    be written, oldest first. `err` holds the first write error
+//    until io61_flush reports it.
+//
+//    All fields below `wakefd` are protected by `m`.
+
+struct io61_abuf {
+    unsigned char* buf;
+    off_t tag = -1;
+    off_t end_tag = -1;
+};
+
+struct io61_async {
+    std::vector<io61_abuf> bufs;
+    unsigned char* data;
+    bool seekable;
+    int wakefd[2] = {-1, -1};   // interrupts a thread waiting on a pipe
+
+    std::mutex m;
+    std::condition_variable wake_thread;
+    std::condition_variable wake_app;
+    size_t cur = 0;
+    size_t ready = 0;
+    size_t depth = 1;
+    off_t next_tag;             // file offset of the next read
+    size_t next_size;           // size of the next read
+    unsigned gen = 0;
+    bool busy = false;          // thread is reading
+    bool eof = false;
+    int err = 0;                // errno from a failed read or write, or 0
+    bool stop = false;
+    std::thread thread;
+    io61_stats stats = {};      // the thread's system calls
+};
+
+// Size of each asynchronous buffer
+static constexpr size_t io61_async_bufsize = 65536;
+
+
+// io61_uring
+//    io_uring backend (see io61_seturing). `sq_*` and `cq_*` point into
+//    the submission and completion rings shared with the kernel. The
+//    file is registered as fixed file 0 when possible, and `regbufs`
+//    lists the registered buffers (`cbuf`, the block cache, and the
+//    write buffers), which is empty if the kernel refused them.
+//
+//    Writing: a full buffer becomes a queued write, linked to the one
+//    before it so the kernel performs them in order. Queued writes are
+//    submitted together once all `io61_uring_batch` buffers are full, or
+//    by io61_flush.
+
+static constexpr unsigned io61_uring_batch = 8;
+
+struct io61_uring {
+    int fd;
+    unsigned char* sq_ring = (unsigned char*) MAP_FAILED;
+    size_t sq_ring_size = 0;
+    unsigned char* cq_ring = (unsigned char*) MAP_FAILED;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*) MAP_FAILED;
+    size_t sqes_size = 0;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    bool fixed_file = false;
+    std::vector<struct iovec> regbufs;
+    unsigned char* wdata = nullptr;     // write buffers
+    unsigned nqueued = 0;               // writes queued but not submitted
+    size_t wlen[io61_uring_batch];      // length of each queued write
+};
+
+
+// io61_shared
+//    Thread-safe mode of a write-only file (see io61_setshared). `word`
+//    holds a buffer generation in its high bits and the bytes reserved
+//    in `buf` in its low `io61_shared_bits`. A writer reserves space by
+//    adding its length to `word`, copies its characters in while other
+//    writers copy theirs, and adds the length to `done`.
+//
+//    The writer whose reservation crosses the end of `buf` seals it:
+//    once `done` shows that every reservation before its own is copied
+//    in, it writes the buffer, then its own characters, and starts the
+//    next generation. Writers that reserved past the end wait on `wake`
+//    for the generation to change, then reserve again. `m` only guards
+//    that wait.
+
+static constexpr int io61_shared_bits = 40;
+
+struct io61_shared {
+    unsigned char* buf;
+    size_t cap;
+    std::atomic<uint64_t> word = 0;
+    std::atomic<size_t> done = 0;
+    std::atomic<bool> err = false;      // a write failed since io61_flush
+    std::mutex m;
+    std::condition_variable wake;
+};
+
+
+// io61_zblock, io61_compress
+//    Compressed mode (see io61_setcompress). The stream is an 8-byte
+//    header, then one frame per block of at most `io61_z_block`
+//    characters: a 4-byte payload length, whose top bit marks a block
+//    stored uncompressed, a 4-byte block length, and the payload. An
+//    all-zero frame header ends the stream, or, in a pipe, end of file.
+//    In a seekable file, the end frame is followed by a trailer holding
+//    the block index (the raw and stream offsets of each block, then of
+//    the end, 8 bytes each), the number of index entries, and another
+//    magic number. Integers are little-endian, and stream offsets count
+//    from the header.
+//
+//    `index` holds the blocks known so far, in order. Its last entry is
+//    the start of the next unknown block, or the end of the stream once
+//    `complete`. A reader's file position is at block `next`.
+
+struct io61_zblock {
+    off_t raw;                  // offset in the uncompressed data
+    off_t off;                  // offset of the frame in the stream
+};
+
+struct io61_compress {
+    unsigned char* zbuf;        // one compressed payload
+    std::vector<io61_zblock> index;
+    size_t next = 0;
+    off_t base = 0;             // file offset of the header, if seekable
+    bool started = false;       // reader has checked the header
+    bool complete = false;
+    bool trailer_tried = false; // reader has looked for the trailer
+    bool eof = false;           // reader has reached the end frame
+};
+
+static constexpr size_t io61_z_block = 65536;
+static constexpr unsigned char io61_z_magic[8] = {
+    'I', 'O', '6', '1', 'Z', 0, 0, 1
+};
+static constexpr unsigned char io61_z_trailer_magic[8] = {
+    'I', 'O', '6', '1', 'Z', 'I', 'X', 1
+};
+
+
+// io61_gather_config
+//    Parallel gather settings (see io61_setgather).
+
+struct io61_gather_config {
+    size_t nthreads = 4;
+    size_t nbuffers = 16;
+};
+
+static io61_gather_config gather_config;
+
+// Size of each gather buffer
+static constexpr size_t io61_gather_chunk = 1 << 20;
+
+
+// io61_gather_buf, io61_gather_state
+//    State of one io61_gather call. Chunks of input are numbered in
+//    output order; chunk `seq` goes in buffer `seq % bufs.size()`.
+//    Workers claim chunk `next` while it is less than `emit +
+//    bufs.size()`, read it, and mark it ready; the writer writes chunk
+//    `emit` once it is ready. Regions of a seekable input are read by
+//    offset, so any number of workers read it at once; other inputs
+//    are read in order by one worker at a time (`busy`). All fields
+//    are protected by `m`.
+
+struct io61_gather_buf {
+    unsigned char* buf;
+    ssize_t n;                  // characters read, or -1 on error
+    bool ready = false;
+};
+
+struct io61_gather_state {
+    io61_file* const* in;
+    size_t nin;
+    std::vector<io61_gather_buf> bufs;
+
+    std::mutex m;
+    std::condition_variable wake_workers;
+    std::condition_variable wake_writer;
+    size_t next = 0;            // next chunk to claim
+    size_t emit = 0;            // next chunk to write
+    size_t cur = 0;             // input being divided into chunks
+    off_t cur_off = -1;         // next offset in `in[cur]`, or -1 if a stream
+    off_t cur_end = 0;          // end of `in[cur]` if seekable
+    bool busy = false;          // a worker is reading stream `in[cur]`
+    size_t remaining;           // characters still to claim
+    bool stop = false;          // the writer gave up
+};
+
+
+// io61_extents
+//    Dirty extents of a positional writer, keyed by file offset.
+
+using io61_extents = std::map<off_t, std::vector<unsigned char>>;
+
+
 // io61_file
-//    Data structure for io61 file wrappers. Add your own stuff.
+//    Data structure for io61 file wrappers. Add your own stuff. It must
+//    stay standard-layout, since io61_cursor_of casts an io61_file*
+//    straight to its first member; hold containers that aren't, like
+//    std::map, by pointer.
 
 struct io61_file {
+    io61_cursor cur = {};       // inline readc/writec cursor; must be first
     int fd;
     int mode;
-    static constexpr off_t bufsize = 4096;
-    unsigned char cbuf[bufsize];
+    off_t bufsize;              // size of `cbuf` (see io61_adapt)
+    unsigned char* cbuf = nullptr;      // drawn from the pool on demand
+    unsigned char* buf;         // cached data: `cbuf`, a slot, or the mapping
+    off_t bufcap;               // bytes `buf` can hold for writing
     off_t tag;
     off_t end_tag;
     off_t pos_tag;
+
+    // Block cache (seekable read-only files that aren't mapped)
+    std::vector<io61_slot> slots;
+    unsigned char* slot_data = nullptr;
+    size_t assoc = 0;           // slots per set
+    off_t blocksize = 0;
+    unsigned long lru_clock = 0;
+    off_t size = 0;             // file size including dirty pages (O_RDWR),
+                                // or as written so far (sparse writers)
+
+    // Memory mapping: the whole of a regular read-only file, or the
+    // output of a write-only file of known size (see io61_setsize)
+    unsigned char* map = nullptr;
+    size_t map_size = 0;
+    int map_advice = MADV_NORMAL;
+
+    // Access pattern detection (see io61_observe_seek)
+    io61_pattern pattern = io61_forward;
+    io61_pattern candidate = io61_forward;
+    int candidate_count = 0;    // consecutive seeks matching `candidate`
+    off_t seek_tag = -1;        // target of last seek
+    off_t stride = 0;           // distance between last two seek targets
+    bool pattern_fixed = false; // `pattern` was set by io61_advise
+
+    // Asynchronous mode (see io61_setasync)
+    io61_async* async = nullptr;
+
+    // io_uring backend (see io61_seturing)
+    io61_uring* uring = nullptr;
+
+    // Lines that span refills (see io61_getdelim)
+    std::vector<unsigned char> linebuf;
+
+    // Out-of-order writes (see io61_seek). Once a seekable writer seeks,
+    // its writes are kept as dirty extents keyed by file offset, and
+    // written back in offset order.
+    bool positional = false;
+    io61_extents* dirty = nullptr;      // allocated when `positional` is set
+    size_t dirty_bytes = 0;
+
+    // I/O counters, reported by io61_profile_end
+    io61_stats stats = {};
+
+    // Flush policy (see io61_setflush)
+    int flush_policy = IO61_FLUSH_THROUGHPUT;
+    long long pending_ns = -1;  // when buffered output last became pending
+    io61_file* pair = nullptr;  // paired reader or writer
+
+    // O_DIRECT mode (see io61_open_check)
+    bool direct = false;
+
+    // Sparse files. Readers remember the last data or hole extent they
+    // looked up (see io61_extent); sparse writers skip zero blocks (see
+    // io61_setsparse).
+    off_t extent_tag = 0;
+    off_t extent_end = 0;
+    bool extent_hole = false;
+    bool sparse = false;
+
+    // Thread-safe mode (see io61_setshared)
+    io61_shared* shared = nullptr;
+
+    // Compressed mode (see io61_setcompress). Tags count uncompressed
+    // characters.
+    io61_compress* z = nullptr;
+
+    // Positioned I/O from several threads (see io61_pread)
+    std::mutex plock;
+    std::condition_variable pfilled;    // a `filling` slot was filled
+    unsigned pfilling = 0;              // number of `filling` slots
+
+    // Buffer pool membership (see io61_pool)
+    size_t pool_index;          // position in `buffer_pool.files`
+    std::thread::id pool_owner; // thread that drew the buffer
+    bool pool_ref = false;      // buffer used since the clock hand passed
+    bool pool_pin = false;      // io61_getdelim returned a view of `cbuf`
+
+    // Buffer growth (see io61_adapt)
+    bool adaptive = true;
+    unsigned adapt_count = 0;   // full transfers at the current size
+    long long adapt_ns = 0;     // time spent in them
+    double adapt_rate = 0;      // bytes per ns at the previous size
 };
 
+static_assert(std::is_standard_layout<io61_file>::value
+              && offsetof(io61_file, cur) == 0,
+              "io61_cursor_of needs the cursor at offset 0");
 
-// io61_fdopen(fd, mode)
-//    Return a new io61_file for file descriptor `fd`. `mode` is
-//    either O_RDONLY for a read-only file or O_WRONLY for a
-//    write-only file. You need not support read/write files.
+// Dirty extents are written back once they hold this many bytes, or
+// this many extents.
+static constexpr size_t io61_dirty_max = 32 << 20;
+static constexpr size_t io61_dirty_max_extents = 65536;
 
-io61_file* io61_fdopen(int fd, int mode) {
-    assert(fd >= 0);
-    io61_file* f = new io61_file;
-    f->fd = fd;
-    f->mode = mode;
-    return f;
+// Buffers grow up to this size, measuring throughput over this many
+// full transfers at each size.
+static constexpr off_t io61_buf_max = 1 << 20;
+static constexpr unsigned io61_adapt_window = 8;
+
+// Adaptive flushing holds output back for at most this many ns.
+static constexpr long long io61_flush_deadline = 1000000;
+
+// O_DIRECT transfers, and the buffers that take part in them, are
+// aligned to this many bytes.
+static constexpr off_t io61_direct_align = 4096;
+
+// Sparse writers leave holes for aligned zero blocks of this size.
+static constexpr off_t io61_sparse_block = 4096;
+
+// Vectored transfers pass at most this many segments per system call.
+static constexpr int io61_iov_max = 64;
+
+
+// io61_alloc(size)
+//    Return a new `size`-byte buffer aligned for O_DIRECT transfers.
+//    Release it with free().
+
+static unsigned char* io61_alloc(size_t size) {
+    void* p;
+    if (posix_memalign(&p, io61_direct_align, size) != 0) {
+        throw std::bad_alloc();
+    }
+    return (unsigned char*) p;
 }
 
 
-// io61_close(f)
-//    Close the io61_file `f` and release all its resources.
+// io61_direct_off(f)
+//    Take `f` out of O_DIRECT mode, for configurations whose transfers
+//    can't be kept aligned or when the file system rejects O_DIRECT.
 
-int io61_close(io61_file* f) {
-    io61_flush(f);
-    int r = close(f->fd);
-    delete f;
-    return r;
+static void io61_direct_off(io61_file* f) {
+    if (f->direct) {
+        fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_DIRECT);
+        f->direct = false;
+    }
 }
 
 
-// io61_fill(f)
-//    Fill the read cache
+// io61_sync(f)
+//    Fold characters read or written through the inline cursor into
+//    `f->pos_tag` and `f->end_tag`, then disarm the cursor. Every
+//    out-of-line entry point calls this first, so the rest of io61
+//    never sees a stale position. Each character read through the
+//    cursor counts as a hit.
 
-int io61_fill(io61_file* f) {
-    // Reset the cache
-    f->tag = f->pos_tag = f->end_tag;
+static void io61_sync(io61_file* f) {
+    if (f->cur.rend) {
+        f->stats.hits += f->cur.rpos - &f->buf[f->pos_tag - f->tag];
+        f->pos_tag = f->tag + (f->cur.rpos - f->buf);
+    } else if (f->cur.wend) {
+        f->end_tag = f->pos_tag = f->tag + (f->cur.wpos - f->buf);
+        if (f->map) {
+            f->size = std::max(f->size, f->pos_tag);
+        }
+    }
+    f->cur = {};
+    f->pool_pin = false;
+}
 
-    // Fill the cache with up to (bufsize) characters
-    int n = read(f->fd, f->cbuf, f->bufsize);
-    if (n >= 0) {
-        f->end_tag = f->tag + n;
-        return n;
+
+// io61_count_read(s, n), io61_count_write(s, n)
+//    Count a read or write system call that returned `n` in `s`.
+
+static void io61_count_read(io61_stats& s, ssize_t n) {
+    ++s.reads;
+    if (n > 0) {
+        s.bytes_read += n;
+    }
+}
+
+static void io61_count_write(io61_stats& s, ssize_t n) {
+    ++s.writes;
+    if (n > 0) {
+        s.bytes_written += n;
+    }
+}
+
+
+// io61_lseek(f, off, whence)
+//    Like lseek(2) on `f`'s file descriptor, but counted.
+
+static off_t io61_lseek(io61_file* f, off_t off, int whence) {
+    ++f->stats.seeks;
+    return lseek(f->fd, off, whence);
+}
+
+
+// io61_pool
+//    Process-wide pool of stream buffers, holding at most about `cap`
+//    bytes. A file draws its buffer when it first needs one
+//    (io61_pool_get). When the pool is full, buffers are reclaimed from
+//    idle files in CLOCK order: a file that used its buffer since the
+//    hand last passed gets a second chance, so files in active use keep
+//    their buffers. If nothing can be reclaimed, the pool goes over `cap`
+//    rather than fail, and buffers don't grow while it is over.
+//
+//    Files may be used by different threads, so `lock` protects the
+//    pool, and a thread only reclaims buffers it drew itself.
+
+struct io61_pool {
+    size_t cap = 32 << 20;
+    std::atomic<size_t> used = 0;
+    std::vector<io61_file*> files;      // files holding a buffer
+    size_t hand = 0;
+    std::recursive_mutex lock;
+};
+
+static io61_pool buffer_pool;
+
+
+// io61_pool_free(f)
+//    Return the buffer of `f`, if any, to the pool.
+
+static void io61_pool_free(io61_file* f) {
+    if (!f->cbuf) {
+        return;
+    }
+    if (f->buf == f->cbuf) {
+        f->buf = nullptr;
+    }
+    free(f->cbuf);
+    f->cbuf = nullptr;
+    io61_pool& p = buffer_pool;
+    std::lock_guard<std::recursive_mutex> guard(p.lock);
+    p.used -= f->bufsize;
+    p.files[f->pool_index] = p.files.back();
+    p.files[f->pool_index]->pool_index = f->pool_index;
+    p.files.pop_back();
+}
+
+
+// io61_pool_reclaim(f)
+//    Take the buffer of `f` back into the pool, flushing any characters
+//    written to it and arranging for unread ones to be read again.
+//    Returns false if that isn't possible.
+
+static bool io61_pool_reclaim(io61_file* f) {
+    if (f->uring || f->pool_pin || f->z) {
+        return false;
+    }
+    io61_sync(f);
+    if (f->buf == f->cbuf) {
+        if (f->mode != O_RDONLY) {
+            if (f->end_tag != f->tag && io61_flush(f) < 0) {
+                return false;
+            }
+        } else if (f->pos_tag < f->end_tag
+                   && io61_lseek(f, f->pos_tag, SEEK_SET) != f->pos_tag) {
+            // A pipe's unread characters can't be read again
+            return false;
+        }
+        f->tag = f->end_tag = f->pos_tag;
+    }
+    io61_pool_free(f);
+    return true;
+}
+
+
+// io61_pool_get(f)
+//    Make sure `f` has a buffer, drawing one from the pool if necessary,
+//    and mark it used.
+
+static void io61_pool_get(io61_file* f) {
+    f->pool_ref = true;
+    if (!f->cbuf) {
+        io61_pool& p = buffer_pool;
+        std::lock_guard<std::recursive_mutex> guard(p.lock);
+        std::thread::id self = std::this_thread::get_id();
+        // The hand passes each file at most twice
+        for (size_t n = 2 * p.files.size();
+             n != 0 && !p.files.empty() && p.used + f->bufsize > p.cap;
+             --n) {
+            p.hand %= p.files.size();
+            io61_file* v = p.files[p.hand];
+            if (v->pool_owner != self) {
+                ++p.hand;
+            } else if (v->pool_ref) {
+                v->pool_ref = false;
+                ++p.hand;
+            } else if (!io61_pool_reclaim(v)) {
+                ++p.hand;
+            }
+        }
+        f->cbuf = io61_alloc(f->bufsize);
+        p.used += f->bufsize;
+        f->pool_index = p.files.size();
+        f->pool_owner = self;
+        p.files.push_back(f);
+    }
+    if (!f->buf) {
+        f->buf = f->cbuf;
+    }
+}
+
+
+// io61_resize(f, size)
+//    Replace the buffer of `f` with one of `size` bytes, keeping the
+//    characters it caches, which must fit.
+
+static void io61_resize(io61_file* f, off_t size) {
+    if (f->cbuf) {
+        unsigned char* cbuf = io61_alloc(size);
+        if (f->buf == f->cbuf) {
+            assert(f->end_tag - f->tag <= size);
+            memcpy(cbuf, f->cbuf, f->end_tag - f->tag);
+            f->buf = cbuf;
+        }
+        free(f->cbuf);
+        f->cbuf = cbuf;
+        buffer_pool.used += size - f->bufsize;
+    }
+    if (f->buf == f->cbuf) {
+        f->bufcap = size;
+    }
+    f->bufsize = size;
+}
+
+
+// io61_adapt(f, n, t0)
+//    Account for a buffer-sized read or write on `f` that started at
+//    time `t0` and transferred `n` bytes. After `io61_adapt_window` full
+//    transfers in a row, the buffer doubles if their throughput beat
+//    the previous size's by a tenth. Once throughput stops improving,
+//    or the buffer reaches `io61_buf_max`, its size is final.
+
+static void io61_adapt(io61_file* f, ssize_t n, const timespec& t0) {
+    if (n != f->bufsize) {
+        f->adapt_count = 0;
+        f->adapt_ns = 0;
+        return;
+    }
+    timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    f->adapt_ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL
+        + (t1.tv_nsec - t0.tv_nsec);
+    if (++f->adapt_count < io61_adapt_window) {
+        return;
+    }
+
+    double rate = (double) (f->bufsize * f->adapt_count)
+        / std::max(f->adapt_ns, 1LL);
+    if (rate < f->adapt_rate * 1.1 || f->bufsize * 2 > io61_buf_max) {
+        f->adaptive = false;
+    } else if (buffer_pool.used + f->bufsize > buffer_pool.cap) {
+        // No room to grow for now
+    } else {
+        f->adapt_rate = rate;
+        io61_resize(f, f->bufsize * 2);
+    }
+    f->adapt_count = 0;
+    f->adapt_ns = 0;
+}
+
+
+// io61_map(f)
+//    Try to map the regular file `f` into memory. On success, the
+//    whole file becomes the cache (`tag == 0`, `end_tag == size`), so
+//    reads and seeks never make system calls. Returns false if `f`
+//    should use the buffered path instead. (The mapping assumes the file
+//    is not truncated while open, just like any other mmap reader.)
+
+static bool io61_map(io61_file* f) {
+    off_t size = io61_filesize(f);
+    if (size <= 0 || (uintmax_t) size > SIZE_MAX) {
+        return false;
+    }
+    void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, f->fd, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    f->map = f->buf = (unsigned char*) p;
+    f->map_size = size;
+    f->tag = 0;
+    f->end_tag = size;
+    // Until the first seek, expect a sequential scan
+    f->map_advice = MADV_SEQUENTIAL;
+    madvise(f->map, f->map_size, f->map_advice);
+    return true;
+}
+
+
+// io61_extent(f, pos, hole)
+//    Find the run of data or hole containing `pos` in the seekable
+//    read-only file `f`, using SEEK_DATA and SEEK_HOLE. Sets `hole` and
+//    returns the end of the run, or returns -1 if `pos` is at end of file
+//    or the file system can't tell. The last run found is remembered, so
+//    scans look up each run once. Moves the file position, so streaming
+//    files mustn't use it.
+
+static off_t io61_extent(io61_file* f, off_t pos, bool& hole) {
+    if (pos >= f->extent_tag && pos < f->extent_end) {
+        hole = f->extent_hole;
+        return f->extent_end;
+    }
+    off_t data = io61_lseek(f, pos, SEEK_DATA);
+    off_t end;
+    if (data < 0 && errno == ENXIO) {
+        // A hole runs to the end of the file, or `pos` is past it
+        data = end = f->map ? f->map_size : io61_filesize(f);
+    } else if (data < 0) {
+        return -1;
+    } else if (data > pos) {
+        end = data;
+    } else {
+        end = io61_lseek(f, pos, SEEK_HOLE);
+    }
+    if (end <= pos) {
+        return -1;
+    }
+    f->extent_tag = pos;
+    f->extent_end = end;
+    f->extent_hole = hole = data > pos;
+    return end;
+}
+
+
+// io61_sequential(f, span)
+//    Return true if the access pattern of `f` predicts a read within
+//    `span` bytes after the current position: a forward scan, or a
+//    strided scan with a positive stride shorter than `span`.
+
+static bool io61_sequential(io61_file* f, off_t span) {
+    return f->pattern == io61_forward
+        || (f->pattern == io61_strided && f->stride > 0 && f->stride < span);
+}
+
+
+// io61_classify_seek(f, pos)
+//    Classify a seek from `f->pos_tag` to `pos` and update
+//    `f->pattern`. A seek to the current position continues a forward
+//    scan; a short step back (like reverse61's) continues a backward
+//    scan; repeating the previous step (like stridecat61's) is a
+//    strided scan. The pattern changes only after two consecutive
+//    seeks agree, so one odd jump doesn't disturb a steady pattern. A
+//    pattern set by io61_advise doesn't change.
+
+static void io61_classify_seek(io61_file* f, off_t pos) {
+    off_t step = f->seek_tag >= 0 ? pos - f->seek_tag : 0;
+    io61_pattern p;
+    if (pos == f->pos_tag) {
+        p = io61_forward;
+    } else if (step < 0 && step >= -f->bufsize) {
+        p = io61_backward;
+    } else if (step > 0 && step == f->stride) {
+        p = io61_strided;
+    } else {
+        p = io61_random;
+    }
+    f->seek_tag = pos;
+    f->stride = step;
+    if (f->pattern_fixed) {
+        return;
+    }
+
+    if (p != f->candidate) {
+        f->candidate = p;
+        f->candidate_count = 1;
+    } else if (++f->candidate_count >= 2) {
+        f->pattern = p;
+    }
+
+    // Tell the kernel what readahead a mapped file needs
+    if (f->map) {
+        int advice;
+        if (f->pattern == io61_forward) {
+            advice = MADV_SEQUENTIAL;
+        } else if (f->pattern == io61_backward
+                   || io61_sequential(f, 2 * f->bufsize)) {
+            advice = MADV_NORMAL;
+        } else {
+            advice = MADV_RANDOM;
+        }
+        if (advice != f->map_advice) {
+            f->map_advice = advice;
+            madvise(f->map, f->map_size, f->map_advice);
+        }
+    }
+}
+
+
+// io61_observe_seek(f, pos)
+//    Note a seek of `f` to `pos` (see io61_classify_seek). Once a
+//    pattern has settled, a seek that repeats the previous step keeps
+//    it with no more work, so a steady backward or strided walk costs
+//    one compare.
+
+static void io61_observe_seek(io61_file* f, off_t pos) {
+    if (pos - f->seek_tag == f->stride && f->seek_tag >= 0
+        && f->candidate == f->pattern && f->candidate_count >= 2) {
+        f->seek_tag = pos;
+    } else {
+        io61_classify_seek(f, pos);
+    }
+}
+
+
+// io61_fill_start(f, pos, size)
+//    Return the file offset at which a `size`-byte fill that must cover
+//    `pos` should start: ending at `pos` for backward scans, starting at
+//    `pos` for forward and strided scans, and at the nearest multiple of
+//    `size` otherwise.
+
+static off_t io61_fill_start(io61_file* f, off_t pos, off_t size) {
+    if (f->pattern == io61_backward) {
+        return std::max(pos + 1 - size, (off_t) 0);
+    } else if (f->pattern == io61_forward || f->pattern == io61_strided) {
+        return pos;
+    } else {
+        return pos - pos % size;
+    }
+}
+
+
+// io61_async_read(f, a, buf, tag, size)
+//    Read up to `size` bytes of an asynchronous file from file offset
+//    `tag` into `buf`. A pipe is polled together with `a->wakefd[0]`, so
+//    io61_async_stop can interrupt the wait; this returns -1 with
+//    `errno == EINTR` if that happens.
+
+static ssize_t io61_async_read(io61_file* f, io61_async* a,
+                               unsigned char* buf, off_t tag, size_t size) {
+    if (a->seekable) {
+        return pread(f->fd, buf, size, tag);
+    }
+    struct pollfd pfd[2];
+    pfd[0].fd = f->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = a->wakefd[0];
+    pfd[1].events = POLLIN;
+    int r = poll(pfd, 2, -1);
+    if (r < 0 || (pfd[1].revents && !pfd[0].revents)) {
+        errno = EINTR;
+        return -1;
+    }
+    return read(f->fd, buf, size);
+}
+
+
+// io61_async_next(f, guard)
+//    Read the buffer after the ready buffers. `guard` holds `a->m`,
+//    which is released during the read unless `guard` is the
+//    application's: then the thread must be idle, and holding the lock
+//    keeps it so.
+
+static void io61_async_next(io61_file* f, std::unique_lock<std::mutex>& guard,
+                            bool in_thread) {
+    io61_async* a = f->async;
+    io61_abuf* b = &a->bufs[(a->cur + 1 + a->ready) % a->bufs.size()];
+    unsigned gen = a->gen;
+    off_t tag = a->next_tag;
+    size_t size = a->next_size;
+    b->tag = b->end_tag = -1;
+
+    if (in_thread) {
+        a->busy = true;
+        guard.unlock();
+    }
+    ssize_t n = io61_async_read(f, a, b->buf, tag, size);
+    int err = errno;
+    io61_count_read(a->stats, n);
+    if (in_thread) {
+        guard.lock();
+        a->busy = false;
+    }
+
+    if (gen != a->gen || a->stop || (n < 0 && err == EINTR)) {
+        // Seek or close happened during the read: drop the data
+    } else if (n < 0) {
+        a->err = err;
+    } else if (n == 0) {
+        a->eof = true;
     } else {
+        b->tag = tag;
+        b->end_tag = a->next_tag = tag + n;
+        a->next_size = io61_async_bufsize;
+        ++a->ready;
+    }
+    if (in_thread) {
+        a->wake_app.notify_one();
+    }
+}
+
+
+// io61_async_reader(f)
+//    Body of the readahead thread.
+
+static void io61_async_reader(io61_file* f) {
+    io61_async* a = f->async;
+    std::unique_lock<std::mutex> guard(a->m);
+    while (true) {
+        a->wake_thread.wait(guard, [&] () {
+            return a->stop || (!a->eof && !a->err && a->ready < a->depth);
+        });
+        if (a->stop) {
+            return;
+        }
+        io61_async_next(f, guard, true);
+    }
+}
+
+
+// io61_async_writer(f)
+//    Body of the write-behind thread. Writes queued buffers in order
+//    and exits once stopped with nothing left to write.
+
+static void io61_async_writer(io61_file* f) {
+    io61_async* a = f->async;
+    size_t n = a->bufs.size();
+    std::unique_lock<std::mutex> guard(a->m);
+    while (true) {
+        a->wake_thread.wait(guard, [&] () {
+            return a->stop || a->ready > 0;
+        });
+        if (a->ready == 0) {
+            return;
+        }
+
+        io61_abuf* b = &a->bufs[(a->cur + n - a->ready) % n];
+        guard.unlock();
+        off_t off = b->tag;
+        int err = 0;
+        while (off != b->end_tag) {
+            ssize_t w = write(f->fd, &b->buf[off - b->tag], b->end_tag - off);
+            io61_count_write(a->stats, w);
+            if (w > 0) {
+                off += w;
+            } else if (w == 0 || errno != EINTR) {
+                err = w == 0 ? EIO : errno;
+                break;
+            }
+        }
+        guard.lock();
+
+        if (err && !a->err) {
+            a->err = err;
+        }
+        --a->ready;
+        a->wake_app.notify_one();
+    }
+}
+
+
+// io61_async_submit(f)
+//    Queue the current write buffer of `f` for the write-behind thread
+//    and switch to a free buffer, waiting if none is free. Returns 0 on
+//    success, or -1 if an earlier background write failed.
+
+static int io61_async_submit(io61_file* f) {
+    io61_async* a = f->async;
+    size_t n = a->bufs.size();
+    std::unique_lock<std::mutex> guard(a->m);
+    if (f->end_tag != f->tag) {
+        a->wake_app.wait(guard, [&] () {
+            return a->ready + 1 < n;
+        });
+        a->bufs[a->cur].tag = f->tag;
+        a->bufs[a->cur].end_tag = f->end_tag;
+        a->cur = (a->cur + 1) % n;
+        ++a->ready;
+        a->wake_thread.notify_one();
+        f->buf = a->bufs[a->cur].buf;
+        f->tag = f->end_tag;
+    }
+    if (a->err) {
+        errno = a->err;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_async_drain(f)
+//    Queue the current write buffer of `f` and wait until the
+//    write-behind thread has written everything. Returns 0 on success.
+//    If any background write failed since the last drain, returns -1
+//    with `errno` set, and clears the error.
+
+static int io61_async_drain(io61_file* f) {
+    io61_async_submit(f);
+    io61_async* a = f->async;
+    std::unique_lock<std::mutex> guard(a->m);
+    a->wake_app.wait(guard, [&] () {
+        return a->ready == 0;
+    });
+    if (a->err) {
+        errno = a->err;
+        a->err = 0;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_async_stop(f)
+//    Stop the helper thread of `f`, if any, and free its buffers. A
+//    write-behind thread first writes all queued buffers.
+
+static void io61_async_stop(io61_file* f) {
+    io61_async* a = f->async;
+    if (!a) {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> guard(a->m);
+        a->stop = true;
+        a->wake_thread.notify_one();
+    }
+    if (a->wakefd[1] >= 0) {
+        ssize_t w = write(a->wakefd[1], "", 1);
+        (void) w;
+    }
+    a->thread.join();
+    f->stats.reads += a->stats.reads;
+    f->stats.writes += a->stats.writes;
+    f->stats.bytes_read += a->stats.bytes_read;
+    f->stats.bytes_written += a->stats.bytes_written;
+    if (a->wakefd[0] >= 0) {
+        close(a->wakefd[0]);
+        close(a->wakefd[1]);
+    }
+    delete[] a->data;
+    delete a;
+    f->async = nullptr;
+    f->buf = f->cbuf;
+    f->bufcap = f->bufsize;
+    f->tag = f->end_tag = f->pos_tag;
+}
+
+
+// io61_async_start(f, nbuffers, seekable)
+//    Start a helper thread for `f` with `nbuffers` buffers: a readahead
+//    thread reading from `f->pos_tag`, or a write-behind thread. Returns
+//    0 on success and -1 on failure.
+
+static int io61_async_start(io61_file* f, size_t nbuffers, bool seekable) {
+    io61_direct_off(f);
+    io61_async* a = new io61_async;
+    a->seekable = seekable;
+    if (f->mode == O_RDONLY && !seekable && pipe(a->wakefd) < 0) {
+        delete a;
+        return -1;
+    }
+    a->data = new unsigned char[nbuffers * io61_async_bufsize];
+    a->bufs.resize(nbuffers);
+    for (size_t i = 0; i != nbuffers; ++i) {
+        a->bufs[i].buf = &a->data[i * io61_async_bufsize];
+    }
+    a->next_tag = f->pos_tag;
+    a->next_size = io61_async_bufsize;
+    f->async = a;
+    f->buf = a->bufs[0].buf;
+    f->bufcap = io61_async_bufsize;
+    f->tag = f->end_tag = f->pos_tag;
+    try {
+        if (f->mode == O_RDONLY) {
+            a->thread = std::thread(io61_async_reader, f);
+        } else {
+            a->thread = std::thread(io61_async_writer, f);
+        }
+    } catch (std::system_error&) {
+        a->stop = true;
+        io61_async_stop(f);
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_async_fill(f)
+//    Make the next readahead buffer the current cache, waiting for the
+//    thread if it isn't ready yet. Each buffer taken in sequence lets
+//    the thread read one more buffer ahead. Returns the number of bytes
+//    available at `f->pos_tag`, 0 at end of file, or -1 on error.
+
+static ssize_t io61_async_fill(io61_file* f) {
+    io61_async* a = f->async;
+    std::unique_lock<std::mutex> guard(a->m);
+    while (a->ready == 0 && !a->eof && !a->err) {
+        if (a->depth == 0 && !a->busy) {
+            // Not reading ahead (the access pattern isn't sequential),
+            // so there's nothing to overlap with: read here and save a
+            // handoff
+            io61_async_next(f, guard, false);
+        } else {
+            a->wake_app.wait(guard);
+        }
+    }
+    if (a->ready == 0) {
+        if (a->err) {
+            errno = a->err;
+            return -1;
+        }
+        return 0;
+    }
+
+    a->cur = (a->cur + 1) % a->bufs.size();
+    --a->ready;
+    io61_abuf* b = &a->bufs[a->cur];
+    if (b->tag == f->end_tag) {
+        a->depth = std::min(a->depth + 1, a->bufs.size() - 1);
+    }
+    if (a->ready < a->depth) {
+        a->wake_thread.notify_one();
+    }
+
+    f->buf = b->buf;
+    f->tag = b->tag;
+    f->end_tag = b->end_tag;
+    return std::max(f->end_tag - f->pos_tag, (off_t) 0);
+}
+
+
+// io61_async_seek(f, pos)
+//    Seek an asynchronous file to `pos`, which is not in the current
+//    cache. If any buffer holds `pos`, it becomes the current cache;
+//    readahead continues after it if it was read ahead, and restarts
+//    after it otherwise. If no buffer holds `pos`, readahead restarts
+//    at a buffer placed by the access pattern. Forward scans and short
+//    strides keep one buffer of readahead; other patterns read only on
+//    demand, a block at a time, until they turn sequential.
+
+static void io61_async_seek(io61_file* f, off_t pos) {
+    io61_async* a = f->async;
+    std::unique_lock<std::mutex> guard(a->m);
+    bool sequential = io61_sequential(f, io61_async_bufsize);
+
+    size_t n = a->bufs.size(), k = 0;
+    while (k != n
+           && !(pos >= a->bufs[(a->cur + 1 + k) % n].tag
+                && pos < a->bufs[(a->cur + 1 + k) % n].end_tag)) {
+        ++k;
+    }
+
+    if (k < a->ready) {
+        // Read ahead already: skip the buffers before it
+        a->cur = (a->cur + 1 + k) % n;
+        a->ready -= k + 1;
+    } else {
+        // Restart readahead, after an old buffer or at `pos`
+        ++a->gen;
+        a->ready = 0;
+        a->depth = sequential ? 1 : 0;
+        a->eof = false;
+        a->err = 0;
+        if (k != n) {
+            a->cur = (a->cur + 1 + k) % n;
+            a->next_tag = a->bufs[a->cur].end_tag;
+            a->next_size = io61_async_bufsize;
+        } else {
+            a->next_size = f->pattern == io61_backward || sequential
+                ? io61_async_bufsize : f->bufsize;
+            a->next_tag = io61_fill_start(f, pos, a->next_size);
+        }
+    }
+    if (a->ready < a->depth) {
+        a->wake_thread.notify_one();
+    }
+
+    if (k != n) {
+        f->buf = a->bufs[a->cur].buf;
+        f->tag = a->bufs[a->cur].tag;
+        f->end_tag = a->bufs[a->cur].end_tag;
+    } else {
+        // Empty cache that no buffer continues
+        f->tag = f->end_tag = -1;
+    }
+}
+
+
+// io61_uring_prep(f, op, buf, sz, off, data)
+//    Add a `sz`-byte read or write (`op` is IORING_OP_READ or
+//    IORING_OP_WRITE) at file offset `off` to the submission ring of
+//    `f`. `off == -1` means the file position. Registered buffers and
+//    the fixed file are used when possible. The request's completion
+//    will carry `data`.
+
+static io_uring_sqe* io61_uring_prep(io61_file* f, int op, unsigned char* buf,
+                                     size_t sz, off_t off, uint64_t data) {
+    io61_uring* u = f->uring;
+    unsigned tail = *u->sq_tail;
+    io_uring_sqe* sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    if (op == IORING_OP_READ) {
+        ++f->stats.reads;
+    } else {
+        ++f->stats.writes;
+    }
+    for (size_t i = 0; i != u->regbufs.size(); ++i) {
+        unsigned char* base = (unsigned char*) u->regbufs[i].iov_base;
+        if (buf >= base && buf + sz <= base + u->regbufs[i].iov_len) {
+            sqe->opcode = op == IORING_OP_READ ? IORING_OP_READ_FIXED
+                : IORING_OP_WRITE_FIXED;
+            sqe->buf_index = i;
+            break;
+        }
+    }
+    if (u->fixed_file) {
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = f->fd;
+    }
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = sz;
+    sqe->off = off;
+    sqe->user_data = data;
+    u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+
+// io61_uring_run(f, n, res)
+//    Submit the `n` requests prepared on `f` with one io_uring_enter(2)
+//    and wait for all of them. The result of the request with data `i`
+//    is stored in `res[i]`: a byte count, or a negative errno. Returns
+//    -1 if the requests couldn't be submitted.
+
+static int io61_uring_run(io61_file* f, unsigned n, int* res) {
+    io61_uring* u = f->uring;
+    unsigned to_submit = n;
+    while (true) {
+        unsigned ncomplete = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)
+            - *u->cq_head;
+        if (to_submit == 0 && ncomplete >= n) {
+            break;
+        }
+        int r = syscall(__NR_io_uring_enter, u->fd, to_submit,
+                        n - std::min(ncomplete, n), IORING_ENTER_GETEVENTS,
+                        nullptr, 0);
+        if (r >= 0) {
+            to_submit -= r;
+        } else if (errno != EINTR) {
+            // Take back requests the kernel never saw
+            __atomic_store_n(u->sq_tail, *u->sq_tail - to_submit,
+                             __ATOMIC_RELEASE);
+            n -= to_submit;
+            if (n == 0) {
+                return -1;
+            }
+            to_submit = 0;
+        }
+    }
+
+    unsigned head = *u->cq_head;
+    for (unsigned i = 0; i != n; ++i, ++head) {
+        io_uring_cqe* cqe = &u->cqes[head & u->cq_mask];
+        res[cqe->user_data] = cqe->res;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+// io61_uring_io(f, op, buf, sz, off)
+//    Like pread(2) or pwrite(2), or read(2) or write(2) if `off == -1`,
+//    but through the io_uring of `f`. `op` is IORING_OP_READ or
+//    IORING_OP_WRITE.
+
+static ssize_t io61_uring_io(io61_file* f, int op, unsigned char* buf,
+                             size_t sz, off_t off) {
+    int res;
+    io61_uring_prep(f, op, buf, sz, off, 0);
+    if (io61_uring_run(f, 1, &res) < 0) {
+        return -1;
+    } else if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    if (op == IORING_OP_READ) {
+        f->stats.bytes_read += res;
+    } else {
+        f->stats.bytes_written += res;
+    }
+    return res;
+}
+
+
+// io61_uring_preadv(f, iov, iovcnt, off)
+//    Like preadv(2), but through the io_uring of `f`: every buffer is
+//    read by a separate request, and all requests are submitted
+//    together.
+
+static ssize_t io61_uring_preadv(io61_file* f, const struct iovec* iov,
+                                 int iovcnt, off_t off) {
+    int res[io61_uring_batch];
+    assert(iovcnt > 0 && iovcnt <= (int) io61_uring_batch);
+    for (int i = 0; i != iovcnt; ++i) {
+        io61_uring_prep(f, IORING_OP_READ, (unsigned char*) iov[i].iov_base,
+                        iov[i].iov_len, off, i);
+        off += iov[i].iov_len;
+    }
+    if (io61_uring_run(f, iovcnt, res) < 0) {
+        return -1;
+    } else if (res[0] < 0) {
+        errno = -res[0];
+        return -1;
+    }
+
+    // Count bytes up to the first short read, as preadv would
+    ssize_t n = 0;
+    for (int i = 0; i != iovcnt && res[i] >= 0; ++i) {
+        n += res[i];
+        if ((size_t) res[i] != iov[i].iov_len) {
+            break;
+        }
+    }
+    f->stats.bytes_read += n;
+    return n;
+}
+
+
+// io61_uring_wbuf(f, i)
+//    Return write buffer `i` of `f`.
+
+static unsigned char* io61_uring_wbuf(io61_file* f, unsigned i) {
+    return &f->uring->wdata[i * f->bufsize];
+}
+
+
+// io61_uring_drain(f)
+//    Submit the writes queued on `f` and wait for them. The current
+//    buffer must be empty; afterwards it is the first buffer. Writes the
+//    kernel left short, or canceled because an earlier write in the
+//    chain was short, are finished with write(2). Returns 0 on success
+//    and -1 on error.
+
+static int io61_uring_drain(io61_file* f) {
+    io61_uring* u = f->uring;
+    unsigned n = u->nqueued;
+    int res[io61_uring_batch];
+    assert(f->tag == f->end_tag);
+    u->nqueued = 0;
+    f->buf = io61_uring_wbuf(f, 0);
+    if (n == 0) {
+        return 0;
+    } else if (io61_uring_run(f, n, res) < 0) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i != n; ++i) {
+        if (res[i] < 0 && res[i] != -ECANCELED && res[i] != -EINTR
+            && res[i] != -EAGAIN) {
+            errno = -res[i];
+            return -1;
+        }
+        size_t pos = std::max(res[i], 0);
+        f->stats.bytes_written += pos;
+        while (pos != u->wlen[i]) {
+            ssize_t w = write(f->fd, &io61_uring_wbuf(f, i)[pos],
+                              u->wlen[i] - pos);
+            io61_count_write(f->stats, w);
+            if (w > 0) {
+                pos += w;
+            } else if (w == 0 || errno != EINTR) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+// io61_uring_queue(f)
+//    Queue the current write buffer of `f` and switch to the next one,
+//    submitting the batch if every buffer is queued. Returns 0 on
+//    success and -1 on error.
+
+static int io61_uring_queue(io61_file* f) {
+    io61_uring* u = f->uring;
+    if (f->end_tag == f->tag) {
+        return 0;
+    }
+    if (u->nqueued > 0) {
+        u->sqes[(*u->sq_tail - 1) & u->sq_mask].flags |= IOSQE_IO_LINK;
+    }
+    io61_uring_prep(f, IORING_OP_WRITE, f->buf, f->end_tag - f->tag, -1,
+                    u->nqueued);
+    u->wlen[u->nqueued] = f->end_tag - f->tag;
+    ++u->nqueued;
+    f->tag = f->end_tag;
+
+    int r = 0;
+    if (u->nqueued == io61_uring_batch) {
+        r = io61_uring_drain(f);
+    }
+    f->buf = io61_uring_wbuf(f, u->nqueued);
+    return r;
+}
+
+
+// io61_uring_register(f)
+//    (Re)register the buffers of `f` with its io_uring. Called whenever
+//    the block cache is reallocated. If registration fails, requests use
+//    unregistered buffers.
+
+static void io61_uring_register(io61_file* f) {
+    io61_uring* u = f->uring;
+    if (!u->regbufs.empty()) {
+        syscall(__NR_io_uring_register, u->fd, IORING_UNREGISTER_BUFFERS,
+                nullptr, 0);
+        u->regbufs.clear();
+    }
+    io61_pool_get(f);
+    u->regbufs.push_back({f->cbuf, (size_t) f->bufsize});
+    if (f->slot_data) {
+        u->regbufs.push_back({f->slot_data, f->slots.size() * f->blocksize});
+    }
+    if (u->wdata) {
+        u->regbufs.push_back({u->wdata,
+                              io61_uring_batch * (size_t) f->bufsize});
+    }
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+                u->regbufs.data(), u->regbufs.size()) < 0) {
+        u->regbufs.clear();
+    }
+}
+
+
+// io61_uring_stop(f)
+//    Tear down the io_uring of `f`, if any. A write-only file must be
+//    flushed first.
+
+static void io61_uring_stop(io61_file* f) {
+    io61_uring* u = f->uring;
+    if (!u) {
+        return;
+    }
+    assert(u->nqueued == 0);
+    if (u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring != MAP_FAILED) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    close(u->fd);
+    delete[] u->wdata;
+    delete u;
+    f->uring = nullptr;
+    if (f->mode == O_WRONLY) {
+        f->buf = f->cbuf;
+        f->tag = f->end_tag = f->pos_tag;
+    }
+}
+
+
+// io61_uring_start(f)
+//    Set up an io_uring for `f`. Returns 0 on success and -1 if the
+//    kernel doesn't support io_uring.
+
+static int io61_uring_start(io61_file* f) {
+    io61_direct_off(f);
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, io61_uring_batch, &p);
+    if (fd < 0) {
+        return -1;
+    }
+    io61_uring* u = f->uring = new io61_uring;
+    u->fd = fd;
+
+    // Map the rings; newer kernels share one mapping for both
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->sq_ring_size = u->cq_ring_size =
+            std::max(u->sq_ring_size, u->cq_ring_size);
+    }
+    u->sq_ring = (unsigned char*) mmap(nullptr, u->sq_ring_size,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE,
+                                       fd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = (unsigned char*) mmap(nullptr, u->cq_ring_size,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE,
+                                           fd, IORING_OFF_CQ_RING);
+    }
+    u->sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    u->sqes = (io_uring_sqe*) mmap(nullptr, u->sqes_size,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE,
+                                   fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED
+        || u->sqes == MAP_FAILED) {
+        io61_uring_stop(f);
+        return -1;
+    }
+    u->sq_tail = (unsigned*) (u->sq_ring + p.sq_off.tail);
+    u->sq_mask = *(unsigned*) (u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*) (u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned*) (u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned*) (u->cq_ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned*) (u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (io_uring_cqe*) (u->cq_ring + p.cq_off.cqes);
+
+    u->fixed_file = syscall(__NR_io_uring_register, fd,
+                            IORING_REGISTER_FILES, &f->fd, 1) == 0;
+    if (f->mode == O_WRONLY) {
+        u->wdata = new unsigned char[io61_uring_batch * f->bufsize];
+        f->buf = io61_uring_wbuf(f, 0);
+        f->tag = f->end_tag = f->pos_tag;
+    }
+    io61_uring_register(f);
+    return 0;
+}
+
+
+// io61_le_get(p, n), io61_le_put(p, x, n)
+//    Load or store the `n`-byte little-endian integer at `p`.
+
+static uint64_t io61_le_get(const unsigned char* p, int n) {
+    uint64_t x = 0;
+    for (int i = n - 1; i >= 0; --i) {
+        x = x << 8 | p[i];
+    }
+    return x;
+}
+
+static void io61_le_put(unsigned char* p, uint64_t x, int n) {
+    for (int i = 0; i != n; ++i) {
+        p[i] = x;
+        x >>= 8;
+    }
+}
+
+
+// io61_lz_sequence(op, oend, lit, nlit, offset, mlen)
+//    Append to the compressed block at `op` a sequence of the `nlit`
+//    literals at `lit`, then a match of `mlen` characters `offset` back,
+//    or no match if `mlen == 0`. Returns the new end, or nullptr if it
+//    would pass `oend`.
+
+static unsigned char* io61_lz_sequence(unsigned char* op, unsigned char* oend,
+                                       const unsigned char* lit, size_t nlit,
+                                       size_t offset, size_t mlen) {
+    if ((size_t) (oend - op) < nlit + nlit / 255 + mlen / 255 + 5) {
+        return nullptr;
+    }
+    unsigned char* token = op++;
+    *token = std::min(nlit, (size_t) 15) << 4;
+    if (nlit >= 15) {
+        size_t x = nlit - 15;
+        for (; x >= 255; x -= 255) {
+            *op++ = 255;
+        }
+        *op++ = x;
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen != 0) {
+        *op++ = offset;
+        *op++ = offset >> 8;
+        *token |= std::min(mlen - 4, (size_t) 15);
+        if (mlen - 4 >= 15) {
+            size_t x = mlen - 4 - 15;
+            for (; x >= 255; x -= 255) {
+                *op++ = 255;
+            }
+            *op++ = x;
+        }
+    }
+    return op;
+}
+
+
+// io61_lz_compress(src, n, dst, cap)
+//    Compress the `n` characters at `src`, at most `io61_z_block`, into
+//    at most `cap` characters at `dst`. The format is LZ4's: each
+//    sequence is a token holding a literal count and a match length
+//    minus 4 (4 bits each, continued in extra bytes while they reach
+//    the maximum), the literals, and a 2-byte match offset; the last
+//    sequence is literals only. Matches are found through a hash table
+//    of 4-byte prefixes. The search steps further the longer it goes
+//    without a match, so incompressible data passes quickly. Returns
+//    the compressed length, or 0 if it is more than `cap`.
+
+static size_t io61_lz_compress(const unsigned char* src, size_t n,
+                               unsigned char* dst, size_t cap) {
+    static constexpr int hash_bits = 14;
+    uint16_t table[1 << hash_bits];
+    memset(table, 0, sizeof(table));
+    unsigned char* op = dst;
+    unsigned char* oend = dst + cap;
+    size_t anchor = 0;
+    // Matches start before `limit` and end by `mend`
+    size_t limit = n > 12 ? n - 12 : 0;
+    size_t mend = n - 5;
+    size_t ip = 0;
+    while (ip < limit) {
+        uint32_t seq, rseq;
+        memcpy(&seq, &src[ip], 4);
+        uint32_t h = (seq * 2654435761U) >> (32 - hash_bits);
+        size_t ref = table[h];
+        table[h] = ip;
+        memcpy(&rseq, &src[ref], 4);
+        if (ref >= ip || rseq != seq) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        // Extend the match forward 8 characters at a time, then back
+        size_t len = 4;
+        while (ip + len + 8 <= mend) {
+            uint64_t a, b;
+            memcpy(&a, &src[ip + len], 8);
+            memcpy(&b, &src[ref + len], 8);
+            if (a != b) {
+                len += __builtin_ctzll(a ^ b) >> 3;
+                break;
+            }
+            len += 8;
+        }
+        while (ip + len < mend && src[ip + len] == src[ref + len]) {
+            ++len;
+        }
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            --ip;
+            --ref;
+            ++len;
+        }
+
+        op = io61_lz_sequence(op, oend, &src[anchor], ip - anchor,
+                              ip - ref, len);
+        if (!op) {
+            return 0;
+        }
+        ip += len;
+        anchor = ip;
+    }
+    op = io61_lz_sequence(op, oend, &src[anchor], n - anchor, 0, 0);
+    return op ? op - dst : 0;
+}
+
+
+// io61_lz_length(ip, iend, x)
+//    Add the extra length bytes at `*ip` to `x`, if its 4-bit field is
+//    full. Returns false if they run past `iend`.
+
+static bool io61_lz_length(const unsigned char*& ip, const unsigned char* iend,
+                           size_t& x) {
+    if (x == 15) {
+        unsigned char b;
+        do {
+            if (ip == iend) {
+                return false;
+            }
+            b = *ip++;
+            x += b;
+        } while (b == 255);
+    }
+    return true;
+}
+
+
+// io61_lz_decompress(src, n, dst, cap)
+//    Decompress the block of `n` characters at `src` (see
+//    io61_lz_compress) into at most `cap` characters at `dst`. Returns
+//    the decompressed length, or -1 if the block is corrupt.
+
+static ssize_t io61_lz_decompress(const unsigned char* src, size_t n,
+                                  unsigned char* dst, size_t cap) {
+    const unsigned char* ip = src;
+    const unsigned char* iend = src + n;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + cap;
+    while (ip != iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (!io61_lz_length(ip, iend, nlit)
+            || nlit > (size_t) (iend - ip)
+            || nlit > (size_t) (oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) {
+            break;
+        } else if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (!io61_lz_length(ip, iend, mlen)
+            || offset == 0
+            || offset > (size_t) (op - dst)
+            || mlen + 4 > (size_t) (oend - op)) {
+            return -1;
+        }
+        // An overlapping match repeats its first `offset` characters
+        for (mlen += 4; mlen != 0; ) {
+            size_t k = std::min(mlen, offset);
+            memcpy(op, op - offset, k);
+            op += k;
+            mlen -= k;
+        }
+    }
+    return op - dst;
+}
+
+
+// io61_z_read(f, buf, sz)
+//    Read `sz` characters from the file position of `f` into `buf`,
+//    waiting out short reads from pipes. Returns the number read, which
+//    is short only at end of file, or -1 on error.
+
+static ssize_t io61_z_read(io61_file* f, unsigned char* buf, size_t sz) {
+    size_t pos = 0;
+    while (pos < sz) {
+        ssize_t n = read(f->fd, &buf[pos], sz - pos);
+        io61_count_read(f->stats, n);
+        if (n > 0) {
+            pos += n;
+        } else if (n == 0) {
+            break;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return pos;
+}
+
+
+// io61_z_write(f, iov, iovcnt)
+//    Write all of the `iovcnt` segments of `iov`, which may be changed,
+//    at the file position of `f`. Returns 0 on success and -1 on error.
+
+static int io61_z_write(io61_file* f, struct iovec* iov, int iovcnt) {
+    while (iovcnt != 0) {
+        ssize_t w = writev(f->fd, iov, iovcnt);
+        io61_count_write(f->stats, w);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        } else if (w < 0) {
+            return -1;
+        }
+        for (; iovcnt != 0 && (size_t) w >= iov->iov_len; ++iov, --iovcnt) {
+            w -= iov->iov_len;
+        }
+        if (iovcnt != 0) {
+            iov->iov_base = (unsigned char*) iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+
+// io61_z_frame(h, clen, raw, stored)
+//    Decode the frame header `h` into the payload length `clen`, the
+//    block length `raw`, and whether the block is `stored`. Returns 1
+//    for a block, 0 for the end of the stream, and -1 if `h` is corrupt.
+
+static int io61_z_frame(const unsigned char* h, size_t& clen, size_t& raw,
+                        bool& stored) {
+    clen = io61_le_get(h, 4);
+    raw = io61_le_get(&h[4], 4);
+    stored = clen & 0x80000000U;
+    clen &= 0x7FFFFFFFU;
+    if (clen == 0 && raw == 0 && !stored) {
+        return 0;
+    } else if (clen == 0 || raw == 0 || raw > io61_z_block
+               || (stored ? clen != raw : clen > raw)) {
+        errno = EIO;
+        return -1;
+    }
+    return 1;
+}
+
+
+// io61_z_fill(f)
+//    Fill the cache of the compressed reader `f` with the next block.
+//    Returns the block length, 0 at end of stream, or -1 on error. A
+//    stream that stops short of its end frame also ends there.
+
+static ssize_t io61_z_fill(io61_file* f) {
+    io61_compress* z = f->z;
+    io61_pool_get(f);
+    f->tag = f->pos_tag = f->end_tag;
+    if (!z->started) {
+        unsigned char h[sizeof(io61_z_magic)];
+        ssize_t n = io61_z_read(f, h, sizeof(h));
+        z->started = true;
+        if (n != 0 && (n != (ssize_t) sizeof(h)
+                       || memcmp(h, io61_z_magic, sizeof(h)) != 0)) {
+            // Not a compressed stream: read nothing more
+            z->eof = true;
+            errno = EIO;
+            return -1;
+        }
+        z->eof = n == 0;
+    }
+    if (z->eof) {
+        return 0;
+    }
+
+    unsigned char h[8];
+    size_t clen, raw;
+    bool stored;
+    ssize_t n = io61_z_read(f, h, sizeof(h));
+    int k = n == (ssize_t) sizeof(h) ? io61_z_frame(h, clen, raw, stored)
+        : (n == 0 ? 0 : -1);
+    if (k == 0) {
+        z->eof = true;
+        z->complete = z->complete || n != 0;
+        return 0;
+    } else if (k < 0) {
+        return -1;
+    }
+    unsigned char* payload = stored ? f->cbuf : z->zbuf;
+    if (io61_z_read(f, payload, clen) != (ssize_t) clen
+        || (!stored
+            && io61_lz_decompress(z->zbuf, clen, f->cbuf, raw)
+               != (ssize_t) raw)) {
+        errno = EIO;
+        return -1;
+    }
+    // The index grows as blocks are read
+    if (z->next + 1 == z->index.size()) {
+        io61_zblock b = z->index.back();
+        z->index.push_back({b.raw + (off_t) raw, b.off + 8 + (off_t) clen});
+    }
+    ++z->next;
+    f->end_tag = f->tag + raw;
+    return raw;
+}
+
+
+// io61_z_scan(f)
+//    Add the block after the last one known to the index of the
+//    seekable compressed reader `f`, reading just its frame header.
+//    Returns 0 on success and -1 on error.
+
+static int io61_z_scan(io61_file* f) {
+    io61_compress* z = f->z;
+    io61_zblock b = z->index.back();
+    unsigned char h[8];
+    size_t clen, raw;
+    bool stored;
+    ssize_t n = pread(f->fd, h, sizeof(h), z->base + b.off);
+    io61_count_read(f->stats, n);
+    int k = n == (ssize_t) sizeof(h) ? io61_z_frame(h, clen, raw, stored)
+        : (n == 0 ? 0 : -1);
+    if (k == 0) {
+        z->complete = true;
+    } else if (k > 0) {
+        z->index.push_back({b.raw + (off_t) raw, b.off + 8 + (off_t) clen});
+    }
+    return k < 0 ? -1 : 0;
+}
+
+
+// io61_z_trailer(f)
+//    Load the whole block index of the seekable compressed reader `f`
+//    from the trailer at the end of its file. Returns false if there
+//    is no trailer that matches the blocks known so far.
+
+static bool io61_z_trailer(io61_file* f) {
+    io61_compress* z = f->z;
+    z->trailer_tried = true;
+    struct stat s;
+    unsigned char t[16];
+    if (fstat(f->fd, &s) < 0 || !S_ISREG(s.st_mode) || s.st_size < 16) {
+        return false;
+    }
+    off_t end = s.st_size - 16;
+    ssize_t n = pread(f->fd, t, sizeof(t), end);
+    io61_count_read(f->stats, n);
+    uint64_t count = io61_le_get(t, 8);
+    if (n != (ssize_t) sizeof(t)
+        || memcmp(&t[8], io61_z_trailer_magic, 8) != 0
+        || count < z->index.size()
+        || count > (uint64_t) (end - z->base) / 16) {
+        return false;
+    }
+    std::vector<unsigned char> data(count * 16);
+    n = pread(f->fd, data.data(), data.size(), end - data.size());
+    io61_count_read(f->stats, n);
+    if (n != (ssize_t) data.size()) {
+        return false;
+    }
+
+    // Blocks must be in order, agree with those already read, and end
+    // at the end frame just before the trailer
+    std::vector<io61_zblock> index(count);
+    for (size_t i = 0; i != count; ++i) {
+        index[i].raw = io61_le_get(&data[16 * i], 8);
+        index[i].off = io61_le_get(&data[16 * i + 8], 8);
+        if ((i != 0 && (index[i].raw <= index[i - 1].raw
+                        || index[i].off <= index[i - 1].off))
+            || (i < z->index.size()
+                && (index[i].raw != z->index[i].raw
+                    || index[i].off != z->index[i].off))) {
+            return false;
+        }
+    }
+    if (z->base + index.back().off + 8 + (off_t) data.size() != end) {
+        return false;
+    }
+    z->index = std::move(index);
+    z->complete = true;
+    return true;
+}
+
+
+// io61_z_seek(f, pos)
+//    Move the compressed reader `f` to uncompressed offset `pos`: find
+//    the block holding it, from the trailer or by scanning frame
+//    headers if it isn't known yet, and read that block. Returns 0 on
+//    success and -1 on failure.
+
+static int io61_z_seek(io61_file* f, off_t pos) {
+    io61_compress* z = f->z;
+    while (!z->complete && z->index.back().raw <= pos) {
+        if (!z->trailer_tried && io61_z_trailer(f)) {
+            break;
+        } else if (io61_z_scan(f) < 0) {
+            return -1;
+        }
+    }
+    auto it = std::upper_bound(z->index.begin(), z->index.end(), pos,
+                               [] (off_t p, const io61_zblock& b) {
+                                   return p < b.raw;
+                               });
+    size_t i = it - z->index.begin() - 1;
+    if (io61_lseek(f, z->base + z->index[i].off, SEEK_SET) < 0) {
+        return -1;
+    }
+    z->next = i;
+    z->started = true;
+    z->eof = false;
+    f->end_tag = z->index[i].raw;
+    if (io61_z_fill(f) < 0) {
+        return -1;
+    }
+    f->pos_tag = pos;
+    return 0;
+}
+
+
+// io61_z_size(f)
+//    Return the uncompressed size of the seekable compressed reader `f`,
+//    or -1 if it can't be found.
+
+static off_t io61_z_size(io61_file* f) {
+    io61_compress* z = f->z;
+    while (!z->complete) {
+        if (!z->trailer_tried && io61_z_trailer(f)) {
+            break;
+        } else if (io61_z_scan(f) < 0) {
+            return -1;
+        }
+    }
+    return z->index.back().raw;
+}
+
+
+// io61_z_flush(f)
+//    Write the cache of the compressed writer `f` as one frame. Returns
+//    the number of characters written, or -1 on error.
+
+static ssize_t io61_z_flush(io61_file* f) {
+    io61_compress* z = f->z;
+    size_t len = f->end_tag - f->tag;
+    if (len == 0) {
+        return 0;
+    }
+    // Blocks that don't shrink are stored as they are
+    size_t clen = io61_lz_compress(f->cbuf, len, z->zbuf, len - 1);
+    bool stored = clen == 0;
+    if (stored) {
+        clen = len;
+    }
+    unsigned char h[8];
+    io61_le_put(h, clen | (stored ? 0x80000000U : 0), 4);
+    io61_le_put(&h[4], len, 4);
+    struct iovec iov[2] = {
+        {h, sizeof(h)}, {stored ? f->cbuf : z->zbuf, clen}
+    };
+    if (io61_z_write(f, iov, 2) < 0) {
+        return -1;
+    }
+    io61_zblock b = z->index.back();
+    z->index.push_back({f->end_tag, b.off + 8 + (off_t) clen});
+    f->tag = f->pos_tag = f->end_tag;
+    return len;
+}
+
+
+// io61_z_finish(f, closing)
+//    End the stream of the compressed writer `f`, whose cache must be
+//    empty, with the end frame and, if `f` is seekable, the trailer.
+//    When `f` is `closing`, a pipe's stream is ended by end of file
+//    instead, so a reader that has already stopped reading doesn't
+//    cause SIGPIPE. Returns 0 on success and -1 on error.
+
+static int io61_z_finish(io61_file* f, bool closing) {
+    io61_compress* z = f->z;
+    bool seekable = io61_lseek(f, 0, SEEK_CUR) >= 0;
+    if (closing && !seekable) {
+        return 0;
+    }
+    std::vector<unsigned char> t(8 + (seekable ? 16 * z->index.size() + 16 : 0),
+                                 0);
+    if (!seekable) {
+        struct iovec iov = {t.data(), t.size()};
+        return io61_z_write(f, &iov, 1);
+    }
+    unsigned char* p = &t[8];
+    for (const io61_zblock& b : z->index) {
+        io61_le_put(p, b.raw, 8);
+        io61_le_put(&p[8], b.off, 8);
+        p += 16;
+    }
+    io61_le_put(p, z->index.size(), 8);
+    memcpy(&p[8], io61_z_trailer_magic, 8);
+    struct iovec iov = {t.data(), t.size()};
+    return io61_z_write(f, &iov, 1);
+}
+
+
+// io61_z_stop(f)
+//    Take `f` out of compressed mode. Tags count file offsets again.
+
+static void io61_z_stop(io61_file* f) {
+    if (f->z) {
+        delete[] f->z->zbuf;
+        delete f->z;
+        f->z = nullptr;
+        f->tag = f->end_tag = f->pos_tag =
+            std::max(io61_lseek(f, 0, SEEK_CUR), (off_t) 0);
+    }
+}
+
+
+// io61_fdopen(fd, mode)
+//    Return a new io61_file for file descriptor `fd`. `mode` is
+//    O_RDONLY for a read-only file, O_WRONLY for a write-only file, or
+//    O_RDWR for a read/write file. Regular read-only files are
+//    memory-mapped when possible, other seekable read-only files use the
+//    block cache, and pipes use the buffer. Read/write files must be
+//    seekable; they use the block cache as a page cache whose dirty
+//    pages are written back by io61_flush, io61_close, or eviction.
+//
+//    The buffer starts at the file's preferred I/O size (`st_blksize`),
+//    and grows while sequential transfers get faster (see io61_adapt).
+//    Pipes and sockets start at PIPE_BUF, so each flush is one atomic
+//    write, and only their readers' buffers grow: a bigger write buffer
+//    would hold output back from the other end. Terminals get a small
+//    fixed buffer.
+//
+//    If the environment variable `IO61_URING` is set to a nonzero
+//    number, files use the io_uring backend when the kernel supports
+//    it. If `IO61_ASYNC` is set to a buffer count, files start in
+//    asynchronous mode instead. Files are never compressed unless
+//    the program asks with io61_setcompress.
+
+io61_file* io61_fdopen(int fd, int mode) {
+    assert(fd >= 0);
+    io61_file* f = new io61_file;
+    f->fd = fd;
+    f->mode = mode;
+    f->bufsize = 4096;
+    struct stat s;
+    int sr = fstat(fd, &s);
+    if (sr < 0) {
+        // keep the default
+    } else if (S_ISFIFO(s.st_mode) || S_ISSOCK(s.st_mode)) {
+        f->bufsize = PIPE_BUF;
+        f->adaptive = mode == O_RDONLY;
+    } else if (isatty(fd)) {
+        f->bufsize = 1024;
+        f->adaptive = false;
+    } else if (s.st_blksize > 0) {
+        f->bufsize = std::clamp((off_t) s.st_blksize, (off_t) 512,
+                                (off_t) 65536);
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && (flags & O_DIRECT)) {
+        f->direct = true;
+        f->bufsize = (f->bufsize + io61_direct_align - 1)
+            / io61_direct_align * io61_direct_align;
+    }
+    f->buf = nullptr;
+    f->bufcap = f->bufsize;
+    off_t pos = io61_lseek(f, 0, SEEK_CUR);
+    f->tag = f->end_tag = f->pos_tag = std::max(pos, (off_t) 0);
+    if (mode == O_RDWR || pos < 0 || pos % io61_direct_align != 0) {
+        io61_direct_off(f);
+    }
+    if (mode == O_RDWR && pos >= 0) {
+        f->size = std::max(io61_filesize(f), (off_t) 0);
+        io61_setcache(f, io61_cache_slots, f->bufsize);
+    } else if (mode == O_RDONLY && pos >= 0 && (f->direct || !io61_map(f))) {
+        io61_setcache(f, io61_cache_slots, f->bufsize);
+    }
+    if (const char* uring = getenv("IO61_URING")) {
+        io61_seturing(f, strtol(uring, nullptr, 0));
+    }
+    if (const char* async = getenv("IO61_ASYNC")) {
+        io61_setasync(f, strtoul(async, nullptr, 0));
+    }
+    return f;
+}
+
+
+// io61_setcache(f, nslots, blocksize)
+//    Configure the block cache of the seekable read-only or read/write
+//    file `f` to hold `nslots` aligned blocks of `blocksize` bytes each.
+//    Slots are grouped into sets of `io61_cache_assoc` and replaced LRU
+//    within each set. Drops any memory mapping. If `nslots == 0`, a
+//    read-only `f` reverts to a single streaming buffer. Returns 0 on
+//    success and -1 on failure.
+
+int io61_setcache(io61_file* f, size_t nslots, size_t blocksize) {
+    io61_sync(f);
+    if (f->mode == O_WRONLY
+        || (f->mode == O_RDWR && nslots == 0)
+        || blocksize == 0
+        || blocksize > (size_t) SSIZE_MAX
+        || f->z
+        || io61_lseek(f, 0, SEEK_CUR) < 0
+        || io61_flush(f) < 0) {
+        return -1;
+    }
+
+    io61_async_stop(f);
+    if (f->map) {
+        munmap(f->map, f->map_size);
+        f->map = nullptr;
+    }
+    free(f->slot_data);
+    f->slot_data = nullptr;
+    f->slots.clear();
+    f->buf = f->cbuf;
+    f->tag = f->end_tag = f->pos_tag;
+    if (nslots == 0 || blocksize % io61_direct_align != 0) {
+        io61_direct_off(f);
+    }
+
+    if (nslots == 0) {
+        // The streaming buffer reads from the file position
+        f->blocksize = 0;
+        if (f->uring) {
+            io61_uring_register(f);
+        }
+        return io61_lseek(f, f->pos_tag, SEEK_SET) == f->pos_tag ? 0 : -1;
+    }
+
+    f->assoc = std::min(nslots, io61_cache_assoc);
+    nslots = (nslots + f->assoc - 1) / f->assoc * f->assoc;
+    f->blocksize = blocksize;
+    f->slot_data = io61_alloc(nslots * blocksize);
+    f->slots.resize(nslots);
+    for (size_t i = 0; i != nslots; ++i) {
+        f->slots[i].buf = &f->slot_data[i * blocksize];
+    }
+    if (f->uring) {
+        io61_uring_register(f);
+    }
+    return 0;
+}
+
+
+// io61_setasync(f, nbuffers)
+//    Put `f` in asynchronous mode with a ring of `nbuffers` buffers.
+//
+//    For a read-only file, a helper thread reads ahead while the
+//    application consumes buffers. Readahead starts one buffer ahead
+//    (double buffering) and deepens, up to `nbuffers - 1`, while the
+//    application keeps reading sequentially.
+//
+//    For a write-only file, a full buffer is handed to a helper thread
+//    that writes it while the application fills the next one
+//    (write-behind). io61_flush, io61_seek and io61_close wait for all
+//    queued writes, and io61_flush returns -1 if any of them failed.
+//
+//    Asynchronous mode replaces the io_uring backend. If `nbuffers == 0`,
+//    asynchronous mode is turned off. That is not possible for a
+//    read-only pipe, whose read-ahead data can't be given back. Returns 0
+//    on success and -1 on failure.
+
+int io61_setasync(io61_file* f, size_t nbuffers) {
+    io61_sync(f);
+    bool seekable = io61_lseek(f, 0, SEEK_CUR) >= 0;
+    if (nbuffers == 1 || f->z) {
+        return -1;
+    } else if (f->mode == O_WRONLY) {
+        if (f->map || io61_flush(f) < 0) {
+            return -1;
+        }
+        f->positional = false;
+        f->sparse = false;
+        io61_uring_stop(f);
+        io61_async_stop(f);
+        return nbuffers ? io61_async_start(f, nbuffers, seekable) : 0;
+    } else if (f->mode != O_RDONLY
+               || (!seekable && (f->async || f->pos_tag < f->end_tag))) {
+        return -1;
+    }
+
+    // Drop the mapping, cache, or thread currently in use
+    io61_uring_stop(f);
+    if (seekable && io61_setcache(f, 0, f->bufsize) < 0) {
+        return -1;
+    }
+
+    if (nbuffers == 0) {
+        if (!io61_map(f)) {
+            io61_setcache(f, io61_cache_slots, f->bufsize);
+        }
+        return 0;
+    }
+    return io61_async_start(f, nbuffers, seekable);
+}
+
+
+// io61_seturing(f, enable)
+//    Switch `f` to the io_uring backend if `enable` is nonzero, or back
+//    to plain system calls if it is zero. With io_uring, the block cache
+//    submits the reads for a run of blocks together, and a write-only
+//    file batches up to `io61_uring_batch` buffers per submission. The
+//    file and its buffers are registered with the kernel once, up front.
+//    Returns -1 if `f` is in asynchronous mode or io_uring is
+//    unavailable; `f` then keeps using system calls.
+
+int io61_seturing(io61_file* f, int enable) {
+    io61_sync(f);
+    if (f->async || f->z || (f->map && f->mode == O_WRONLY)
+        || io61_flush(f) < 0) {
+        return -1;
+    }
+    io61_uring_stop(f);
+    if (enable) {
+        f->sparse = false;
+    }
+    return enable ? io61_uring_start(f) : 0;
+}
+
+
+// io61_setbuf(f, size)
+//    Set the buffer of `f` to `size` bytes and stop adapting its size.
+//    Block-cached files keep their block size (see io61_setcache), and
+//    asynchronous files their buffers; theirs is used only if they
+//    switch to the buffer. Returns 0 on success and -1 on failure,
+//    including when `f` has more characters buffered than fit.
+
+int io61_setbuf(io61_file* f, size_t size) {
+    io61_sync(f);
+    if (size == 0
+        || size > (size_t) SSIZE_MAX
+        || f->async
+        || f->z
+        || io61_flush(f) < 0
+        || (f->buf == f->cbuf && f->end_tag - f->tag > (off_t) size)) {
+        return -1;
+    }
+    bool uring = f->uring;
+    io61_uring_stop(f);
+    if (size % io61_direct_align != 0) {
+        io61_direct_off(f);
+    }
+    io61_resize(f, size);
+    f->adaptive = false;
+    return uring ? io61_uring_start(f) : 0;
+}
+
+
+// io61_setpool(cap)
+//    Limit the stream buffers of all io61 files to about `cap` bytes in
+//    total (see io61_pool). The default is 32 MB.
+
+void io61_setpool(size_t cap) {
+    buffer_pool.cap = cap;
+}
+
+
+// io61_setsparse(f, enable)
+//    Turn hole-preserving writes on or off for the write-only file `f`.
+//    A sparse file skips aligned zero blocks written past its end rather
+//    than writing them, leaving holes that read back as zeros, and
+//    io61_flush extends it over a hole at its end with ftruncate(2).
+//    Files start out dense; programs turn this on when their input has
+//    holes (see io61_hasholes). Asynchronous, io_uring, and positional
+//    writers (see io61_seek) write every block, and stop being sparse.
+//    Returns 0 on success and -1 if `f` can't be sparse.
+
+int io61_setsparse(io61_file* f, int enable) {
+    io61_sync(f);
+    if (f->mode != O_WRONLY || io61_flush(f) < 0) {
+        return -1;
+    } else if (!enable) {
+        f->sparse = false;
+        return 0;
+    }
+    off_t size = io61_filesize(f);
+    int flags = fcntl(f->fd, F_GETFL);
+    if (size < 0 || flags < 0 || (flags & O_APPEND)
+        || f->direct || f->async || f->uring || f->positional || f->z) {
+        return -1;
+    }
+    f->sparse = true;
+    f->size = size;
+    return 0;
+}
+
+
+// io61_hasholes(f)
+//    Return 1 if the read-only file `f` has holes, which SEEK_HOLE
+//    reports before its end, and 0 if it has none or can't tell. Only
+//    mapped and block-cached files, whose reads don't depend on the file
+//    position, are checked.
+
+int io61_hasholes(io61_file* f) {
+    io61_sync(f);
+    if (f->mode != O_RDONLY || (!f->map && f->slots.empty())) {
+        return 0;
+    }
+    off_t size = f->map ? (off_t) f->map_size : io61_filesize(f);
+    off_t hole = io61_lseek(f, 0, SEEK_HOLE);
+    return size > 0 && hole >= 0 && hole < size;
+}
+
+
+// io61_setshared(f, enable)
+//    Put the write-only file `f` in thread-safe mode if `enable` is
+//    nonzero, or take it out if it is zero. In thread-safe mode, any
+//    number of threads may call io61_write, io61_writev, io61_writec, and
+//    io61_flush on `f` at once. Each call's characters are written
+//    together, and calls that run at once are written in some order.
+//    Writers reserve space in a shared buffer with an atomic add and copy
+//    into it in parallel; the buffer is written in order once every
+//    reservation in it is complete (see io61_shared). Other functions,
+//    including io61_close and this one, still need the file to
+//    themselves, and io61_seek fails. Thread-safe mode ignores the flush
+//    policy and turns off O_DIRECT. Returns 0 on success and -1 on
+//    failure, including for asynchronous, io_uring, and positional
+//    writers.
+
+int io61_setshared(io61_file* f, int enable) {
+    io61_sync(f);
+    if (f->mode != O_WRONLY || io61_flush(f) < 0) {
+        return -1;
+    } else if (!enable) {
+        if (f->shared) {
+            free(f->shared->buf);
+            delete f->shared;
+            f->shared = nullptr;
+        }
+        return 0;
+    } else if (f->async || f->uring || f->positional || f->map || f->z) {
+        return -1;
+    }
+    if (!f->shared) {
+        io61_direct_off(f);
+        io61_pool_free(f);
+        f->buf = nullptr;
+        f->shared = new io61_shared;
+        f->shared->cap = f->bufsize;
+        f->shared->buf = io61_alloc(f->bufsize);
+    }
+    return 0;
+}
+
+
+// io61_setgather(nthreads, nbuffers)
+//    Make io61_gather read with `nthreads` worker threads and at most
+//    `nbuffers` buffers of `io61_gather_chunk` bytes in flight. The
+//    defaults are 4 threads and 16 buffers.
+
+void io61_setgather(size_t nthreads, size_t nbuffers) {
+    gather_config.nthreads = nthreads;
+    gather_config.nbuffers = nbuffers;
+}
+
+
+// io61_setsize(f, size)
+//    Declare that the output of the write-only file `f` will be `size`
+//    bytes long. If `f` is a regular file, it is extended to `size` and
+//    mapped, and from then on writes and seeks are just copies into the
+//    mapping and pointer moves, in any order, with no system calls.
+//    Writes past `size` extend the file and the mapping. io61_close
+//    unmaps the file, which stays at least `size` bytes long.
+//
+//    A shared writable mapping needs a descriptor open for reading too,
+//    so `f`'s descriptor must have been opened O_RDWR (the io61_file
+//    itself is still write-only). Returns 0 on success and -1 if `f`
+//    can't be mapped; `f` then keeps working as before.
+
+int io61_setsize(io61_file* f, off_t size) {
+    io61_sync(f);
+    off_t old_size = io61_filesize(f);
+    int flags = fcntl(f->fd, F_GETFL);
+    if (f->mode != O_WRONLY || f->map || f->async || f->uring
+        || f->shared || f->z || size <= 0 || (uintmax_t) size > SIZE_MAX
+        || old_size < 0 || flags < 0 || (flags & O_ACCMODE) != O_RDWR
+        || io61_flush(f) < 0) {
+        return -1;
+    }
+
+    size = std::max(size, old_size);
+    void* p = MAP_FAILED;
+    if (ftruncate(f->fd, size) >= 0) {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd,
+                 0);
+    }
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+
+    io61_pool_free(f);
+    f->map = f->buf = (unsigned char*) p;
+    f->map_size = f->size = size;
+    f->tag = 0;
+    f->end_tag = f->pos_tag;
+    f->positional = f->sparse = false;
+    return 0;
+}
+
+
+// io61_setcompress(f, enable)
+//    Put `f` in compressed mode if `enable` is nonzero. A write-only `f`
+//    then writes a compressed stream from its file position on: each
+//    full buffer of `io61_z_block` characters, and each flush, becomes
+//    one block compressed with a fast LZ77 codec, or stored if it
+//    doesn't shrink (see io61_compress). io61_close ends a seekable
+//    stream with an index of its blocks. A read-only `f` reads such a
+//    stream from its file position and returns the original
+//    characters. A seekable reader seeks by loading the index, or, if
+//    the stream has none, by skipping from frame header to frame
+//    header, and io61_filesize returns its uncompressed size.
+//    Compressed writers can't seek. The format is io61's own, so only
+//    compress files and pipes whose other end is an io61 file in
+//    compressed mode too.
+//
+//    Turning compressed mode off ends a writer's stream, after which
+//    plain characters follow, and fails for a reader. Compressed files
+//    aren't mapped, block-cached, asynchronous, thread-safe, or sparse,
+//    and don't use io_uring. Returns 0 on success and -1 on failure.
+
+int io61_setcompress(io61_file* f, int enable) {
+    io61_sync(f);
+    if (!enable) {
+        if (!f->z) {
+            return 0;
+        } else if (f->mode != O_WRONLY) {
+            return -1;
+        }
+        int r = io61_flush(f) < 0 || io61_z_finish(f, false) < 0 ? -1 : 0;
+        io61_z_stop(f);
+        return r;
+    } else if (f->z) {
+        return 0;
+    } else if (f->mode == O_RDWR || f->async || f->uring || f->shared
+               || (f->mode == O_WRONLY && f->map)) {
+        return -1;
+    }
+
+    // Start from an empty buffer at the file position
+    bool seekable = io61_lseek(f, 0, SEEK_CUR) >= 0;
+    if (f->mode == O_WRONLY) {
+        if (io61_flush(f) < 0) {
+            return -1;
+        }
+        f->positional = f->sparse = false;
+        io61_direct_off(f);
+    } else if (seekable ? io61_setcache(f, 0, f->bufsize) < 0
+               : f->pos_tag != f->end_tag) {
+        return -1;
+    }
+    io61_compress* z = f->z = new io61_compress;
+    z->zbuf = new unsigned char[io61_z_block];
+    z->base = seekable ? f->pos_tag : 0;
+    z->index.push_back({0, sizeof(io61_z_magic)});
+    f->tag = f->end_tag = f->pos_tag = 0;
+    io61_resize(f, io61_z_block);
+    f->adaptive = false;
+
+    if (f->mode == O_WRONLY) {
+        struct iovec iov = {(unsigned char*) io61_z_magic,
+                            sizeof(io61_z_magic)};
+        z->started = true;
+        if (io61_z_write(f, &iov, 1) < 0) {
+            io61_z_stop(f);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// io61_setflush(f, policy, pair)
+//    Set when the write-only file `f` flushes: IO61_FLUSH_THROUGHPUT
+//    flushes only full buffers (the default), IO61_FLUSH_LATENCY flushes
+//    after every write call, and IO61_FLUSH_ADAPTIVE flushes output that
+//    has waited `io61_flush_deadline`. There is no timer: the deadline
+//    is checked on each write call to `f` and each refill of its pair,
+//    so an adaptive writer that goes idle holds its output until one
+//    of those happens, or until io61_flush.
+//
+//    If `pair` is not null, it is the read-only file that receives
+//    replies to `f`'s output. Before a read on `pair` that would block,
+//    `f` is flushed, so request/response exchanges can't deadlock on
+//    buffered output.
+//    Returns 0 on success and -1 on failure.
+
+int io61_setflush(io61_file* f, int policy, io61_file* pair) {
+    io61_sync(f);
+    if (f->mode != O_WRONLY
+        || (policy != IO61_FLUSH_THROUGHPUT && policy != IO61_FLUSH_LATENCY
+            && policy != IO61_FLUSH_ADAPTIVE)
+        || (pair && pair->mode != O_RDONLY)) {
+        return -1;
+    }
+    f->flush_policy = policy;
+    if (f->pair) {
+        f->pair->pair = nullptr;
+    }
+    if (pair && pair->pair) {
+        pair->pair->pair = nullptr;
+    }
+    f->pair = pair;
+    if (pair) {
+        pair->pair = f;
+    }
+    return 0;
+}
+
+
+// io61_advise(f, offset, len, hint)
+//    Tell io61 how the seekable read-only file `f` will be read, like
+//    posix_fadvise(2). IO61_ADVISE_SEQUENTIAL and IO61_ADVISE_RANDOM
+//    fix the access pattern of the whole file rather than letting seeks
+//    change it (see io61_observe_seek), and IO61_ADVISE_NORMAL goes back
+//    to detecting it. IO61_ADVISE_WILLNEED starts reading the `len`
+//    bytes at `offset` (to the end of the file if `len == 0`) in the
+//    background, so a later seek into them finds them in memory, and
+//    IO61_ADVISE_DONTNEED lets them go. A mapped file passes the hint
+//    to madvise(2), and reads prefetched pages straight from the page
+//    cache; other files pass it to posix_fadvise(2). Returns 0 on
+//    success and -1 on failure, including for compressed files, whose
+//    offsets aren't file offsets.
+
+int io61_advise(io61_file* f, off_t offset, off_t len, int hint) {
+    static const int madvice[] = {
+        MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED,
+        MADV_DONTNEED
+    };
+    static const int fadvice[] = {
+        POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM,
+        POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED
+    };
+    io61_sync(f);
+    if (f->mode != O_RDONLY || f->z || offset < 0 || len < 0
+        || hint < IO61_ADVISE_NORMAL || hint > IO61_ADVISE_DONTNEED
+        || (!f->map && io61_lseek(f, 0, SEEK_CUR) < 0)) {
+        return -1;
+    }
+
+    // Access patterns apply to the whole file
+    if (hint <= IO61_ADVISE_RANDOM) {
+        f->pattern_fixed = hint != IO61_ADVISE_NORMAL;
+        f->pattern = f->candidate =
+            hint == IO61_ADVISE_RANDOM ? io61_random : io61_forward;
+        f->candidate_count = 0;
+        offset = len = 0;
+        if (f->map) {
+            f->map_advice = madvice[hint];
+        }
+    }
+
+    if (f->map) {
+        if ((size_t) offset >= f->map_size) {
+            return 0;
+        }
+        size_t end = len == 0 || (size_t) len > f->map_size - offset
+            ? f->map_size : offset + len;
+        // madvise needs a page-aligned start
+        size_t start = offset - offset % sysconf(_SC_PAGESIZE);
+        return madvise(&f->map[start], end - start, madvice[hint]);
+    }
+    return posix_fadvise(f->fd, offset, len, fadvice[hint]) == 0 ? 0 : -1;
+}
+
+
+// io61_close(f)
+//    Close the io61_file `f` and release all its resources. Its I/O
+//    counters are passed to io61_profile_record.
+
+int io61_close(io61_file* f) {
+    io61_sync(f);
+    io61_flush(f);
+    if (f->pair) {
+        f->pair->pair = nullptr;
+    }
+    io61_uring_stop(f);
+    io61_async_stop(f);
+    if (f->shared) {
+        free(f->shared->buf);
+        delete f->shared;
+    }
+    if (f->z && f->mode == O_WRONLY) {
+        io61_z_finish(f, true);
+    }
+    io61_z_stop(f);
+    if (f->map) {
+        munmap(f->map, f->map_size);
+        // A mapped writer's mapping may have grown past the output
+        if (f->mode == O_WRONLY && (size_t) f->size < f->map_size) {
+            ftruncate(f->fd, f->size);
+        }
+    }
+    free(f->slot_data);
+    delete f->dirty;
+    io61_pool_free(f);
+    f->stats.fd = f->fd;
+    f->stats.mode = f->mode;
+    io61_profile_record(&f->stats);
+    int r = close(f->fd);
+    delete f;
+    return r;
+}
+
+
+// io61_slot_clean(f, s)
+//    Write back slot `s` of `f` if it is dirty. Returns 0 on success
+//    and -1 on error.
+
+static int io61_slot_clean(io61_file* f, io61_slot* s) {
+    size_t done = 0, len = s->end_tag - s->tag;
+    while (s->dirty && done != len) {
+        ssize_t w = pwrite(f->fd, &s->buf[done], len - done, s->tag + done);
+        io61_count_write(f->stats, w);
+        if (w > 0) {
+            done += w;
+        } else if (w == 0 || errno != EINTR) {
+            return -1;
+        }
+    }
+    s->dirty = false;
+    return 0;
+}
+
+
+// io61_slot_reuse(f, s)
+//    Prepare slot `s` of `f` to hold another block: write it back if it
+//    is dirty, and if it holds the stream's current block (which
+//    io61_pread and io61_pwrite can replace), make the next stream
+//    access refill. Returns 0 on success and -1 on error.
+
+static int io61_slot_reuse(io61_file* f, io61_slot* s) {
+    if (io61_slot_clean(f, s) < 0) {
+        return -1;
+    }
+    if (s->buf == f->buf) {
+        f->tag = f->end_tag = f->pos_tag;
+    }
+    return 0;
+}
+
+
+// io61_cache_find(f, block_tag, victim)
+//    Return the cache slot holding the block at file offset `block_tag`,
+//    or nullptr if that block isn't cached. In that case, `*victim` is set
+//    to the least-recently-used slot in the block's set.
+
+static io61_slot* io61_cache_find(io61_file* f, off_t block_tag,
+                                  io61_slot** victim) {
+    // Hash the block number so power-of-two strides (like stridecat61's)
+    // don't all land in the same set
+    size_t nsets = f->slots.size() / f->assoc;
+    uint64_t hash = (uint64_t) (block_tag / f->blocksize)
+        * 0x9E3779B97F4A7C15ULL;
+    io61_slot* set = &f->slots[((hash >> 32) % nsets) * f->assoc];
+
+    *victim = &set[0];
+    for (size_t i = 0; i != f->assoc; ++i) {
+        if (set[i].tag == block_tag) {
+            return &set[i];
+        } else if (set[i].lru < (*victim)->lru) {
+            *victim = &set[i];
+        }
+    }
+    return nullptr;
+}
+
+
+// io61_cache_load(f, block_tag, victim)
+//    Read the missing block at `block_tag` into slot `victim`, along
+//    with uncached neighbors the access pattern says come next: the
+//    following blocks for forward scans (and strides shorter than a
+//    block), the preceding blocks for backward scans. All blocks are
+//    read by one preadv(2), or one io_uring submission; a run inside a
+//    hole of a sparse file is just zeroed. Dirty victims are written
+//    back first. Returns the block's slot, or nullptr on
+//    error.
+
+static io61_slot* io61_cache_load(io61_file* f, off_t block_tag,
+                                  io61_slot* victim) {
+    int dir = 0;
+    if (io61_sequential(f, f->blocksize)) {
+        dir = 1;
+    } else if (f->pattern == io61_backward) {
+        dir = -1;
+    }
+    size_t maxblocks = std::min(io61_cache_readahead,
+                                std::max(f->slots.size() / 2, (size_t) 1));
+
+    // Collect slots for the run of blocks, in the predicted order. Each
+    // chosen slot is stamped with the current time so it can't be chosen
+    // twice.
+    unsigned long run_start = f->lru_clock + 1;
+    io61_slot* run[io61_cache_readahead];
+    size_t nrun = 0;
+    off_t t = block_tag;
+    while (true) {
+        if (io61_slot_reuse(f, victim) < 0) {
+            return nullptr;
+        }
+        victim->tag = victim->end_tag = -1;
+        victim->lru = ++f->lru_clock;
+        run[nrun] = victim;
+        ++nrun;
+        t += dir * f->blocksize;
+        if (dir == 0 || nrun == maxblocks || t < 0
+            || io61_cache_find(f, t, &victim)
+            || victim->lru >= run_start) {
+            break;
+        }
+    }
+
+    // Read the run in file order
+    off_t first_tag = dir < 0 ? block_tag - (nrun - 1) * f->blocksize
+        : block_tag;
+    struct iovec iov[io61_cache_readahead];
+    for (size_t i = 0; i != nrun; ++i) {
+        io61_slot* s = run[dir < 0 ? nrun - 1 - i : i];
+        iov[i].iov_base = s->buf;
+        iov[i].iov_len = f->blocksize;
+    }
+    ssize_t n;
+    bool hole;
+    off_t run_end = first_tag + nrun * f->blocksize;
+    if (f->mode == O_RDONLY
+        && io61_extent(f, first_tag, hole) >= run_end && hole) {
+        // A run inside a hole reads as zeros without touching the file
+        for (size_t i = 0; i != nrun; ++i) {
+            memset(iov[i].iov_base, 0, iov[i].iov_len);
+        }
+        n = run_end - first_tag;
+    } else if (f->uring) {
+        n = io61_uring_preadv(f, iov, nrun, first_tag);
+    } else {
+        n = preadv(f->fd, iov, nrun, first_tag);
+        io61_count_read(f->stats, n);
+        if (n < 0 && errno == EINVAL && f->direct) {
+            // The file system rejects O_DIRECT
+            io61_direct_off(f);
+            n = preadv(f->fd, iov, nrun, first_tag);
+            io61_count_read(f->stats, n);
+        }
+    }
+    if (n < 0) {
+        return nullptr;
+    }
+
+    // Tag the slots that received data. The requested block is tagged
+    // even at end of file, so the end of file is cached too.
+    for (size_t i = 0; i != nrun; ++i) {
+        io61_slot* s = run[dir < 0 ? nrun - 1 - i : i];
+        off_t tag = first_tag + i * f->blocksize;
+        off_t len = std::min(std::max(n - (off_t) (i * f->blocksize),
+                                      (off_t) 0),
+                             f->blocksize);
+        if (len > 0 || tag == block_tag) {
+            s->tag = tag;
+            s->end_tag = tag + len;
+        }
+    }
+    return run[0];
+}
+
+
+// io61_page_extend(f, s, pos)
+//    Make file offset `pos` readable in slot `s` of `f` if `f` is a
+//    read/write file that has grown past the slot. A short page ended at
+//    end of file when it was read, so anything after it that is now in
+//    the file is a hole left by writes further on, and reads as zeros.
+
+static void io61_page_extend(io61_file* f, io61_slot* s, off_t pos) {
+    if (f->mode == O_RDWR && pos >= s->end_tag) {
+        off_t end = std::min(s->tag + f->blocksize, f->size);
+        if (end > s->end_tag) {
+            memset(&s->buf[s->end_tag - s->tag], 0, end - s->end_tag);
+            s->end_tag = end;
+        }
+    }
+}
+
+
+// io61_cache_block(f, pos)
+//    Return the cache slot holding file offset `pos`, loading it if it
+//    isn't present. Returns nullptr on error.
+
+static io61_slot* io61_cache_block(io61_file* f, off_t pos) {
+    off_t block_tag = pos - pos % f->blocksize;
+    io61_slot* victim;
+    io61_slot* s = io61_cache_find(f, block_tag, &victim);
+
+    if (!s) {
+        ++f->stats.refills;
+        s = io61_cache_load(f, block_tag, victim);
+        if (!s) {
+            return nullptr;
+        }
+    } else if (pos >= s->end_tag
+               && s->end_tag < block_tag + f->blocksize
+               && f->mode != O_RDWR) {
+        ++f->stats.refills;
+        // Hit on a short block: the read ended early, or the file was
+        // at end of file. Try to read the rest. (O_DIRECT rereads the
+        // whole block, since the rest is unaligned.)
+        off_t off = f->direct ? block_tag : s->end_tag;
+        unsigned char* buf = &s->buf[off - block_tag];
+        size_t sz = block_tag + f->blocksize - off;
+        ssize_t n;
+        if (f->uring) {
+            n = io61_uring_io(f, IORING_OP_READ, buf, sz, off);
+        } else {
+            n = pread(f->fd, buf, sz, off);
+            io61_count_read(f->stats, n);
+        }
+        if (n < 0) {
+            return nullptr;
+        }
+        s->end_tag = off + n;
+    } else {
+        ++f->stats.hits;
+    }
+
+    io61_page_extend(f, s, pos);
+    s->lru = ++f->lru_clock;
+    return s;
+}
+
+
+// io61_cache_fill(f)
+//    Make the cache slot holding `f->pos_tag` the current cache, loading
+//    it if it isn't present. Returns the number of bytes available at
+//    `f->pos_tag`, 0 at end of file, or -1 on error.
+
+static ssize_t io61_cache_fill(io61_file* f) {
+    io61_slot* s = io61_cache_block(f, f->pos_tag);
+    if (!s) {
+        return -1;
+    }
+    f->buf = s->buf;
+    f->tag = s->tag;
+    f->end_tag = s->end_tag;
+    return std::max(f->end_tag - f->pos_tag, (off_t) 0);
+}
+
+
+// io61_now()
+//    Return the monotonic time in ns.
+
+static long long io61_now() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+
+// io61_flush_pair(f)
+//    Called before a read on `f` that may block. If `f` is paired with
+//    a writer holding output, that output might be what the other end
+//    is waiting for, so flush it. An adaptive writer keeps batching
+//    while input is ready, since then the read won't block, unless its
+//    output has passed its deadline.
+
+static void io61_flush_pair(io61_file* f) {
+    io61_file* w = f->pair;
+    if (!w || w->pending_ns < 0) {
+        return;
+    }
+    struct pollfd pfd = {f->fd, POLLIN, 0};
+    if (w->flush_policy != IO61_FLUSH_ADAPTIVE
+        || io61_now() - w->pending_ns >= io61_flush_deadline
+        || poll(&pfd, 1, 0) <= 0) {
+        io61_flush(w);
+    }
+}
+
+
+// io61_fill(f)
+//    Fill the read cache
+
+int io61_fill(io61_file* f) {
+    // A mapped file is cached in its entirety, so there is nothing
+    // more to read
+    if (f->map) {
+        return 0;
+    } else if (!f->slots.empty()) {
+        return io61_cache_fill(f);
+    } else if (f->async) {
+        ++f->stats.refills;
+        io61_flush_pair(f);
+        return io61_async_fill(f);
+    } else if (f->z) {
+        ++f->stats.refills;
+        io61_flush_pair(f);
+        return io61_z_fill(f);
+    }
+    ++f->stats.refills;
+    io61_flush_pair(f);
+    io61_pool_get(f);
+
+    // Reset the cache
+    f->tag = f->pos_tag = f->end_tag;
+
+    // Fill the cache with up to (bufsize) characters
+    int n;
+    timespec t0 = {};
+    if (f->uring) {
+        n = io61_uring_io(f, IORING_OP_READ, f->cbuf, f->bufsize, -1);
+    } else {
+        if (f->adaptive) {
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+        }
+        n = read(f->fd, f->cbuf, f->bufsize);
+        io61_count_read(f->stats, n);
+    }
+    if (n >= 0) {
+        f->end_tag = f->tag + n;
+        if (f->adaptive && !f->uring) {
+            io61_adapt(f, n, t0);
+        }
+        return n;
+    } else {
+        return -1;
+    }
+}
+
+
+// io61_direct_size(f)
+//    Return the smallest transfer on `f` that bypasses its buffer, or
+//    SIZE_MAX if `f` never bypasses it. A mapped file has no buffer to
+//    bypass, an asynchronous file's buffers already overlap with the
+//    application, a read/write file's pages may be dirty, an O_DIRECT
+//    file's transfers must use its aligned buffers, and a compressed
+//    file's blocks pass through its buffer.
+
+static size_t io61_direct_size(io61_file* f) {
+    if (f->map || f->async || f->mode == O_RDWR || f->direct || f->z) {
+        return SIZE_MAX;
+    } else if (!f->slots.empty()) {
+        return f->blocksize;
+    } else {
+        return f->bufsize;
+    }
+}
+
+
+// io61_iov_total(iov, iovcnt)
+//    Return the total length of the `iovcnt` segments in `iov`.
+
+static size_t io61_iov_total(const struct iovec* iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+
+// io61_iov_skip(iov, iovcnt, i, off, n)
+//    Advance the position `(i, off)` (offset `off` into segment `iov[i]`)
+//    by `n` characters, past the end of any segments it finishes.
+
+static void io61_iov_skip(const struct iovec* iov, int iovcnt, int& i,
+                          size_t& off, size_t n) {
+    off += n;
+    while (i != iovcnt && off >= iov[i].iov_len) {
+        off -= iov[i].iov_len;
+        ++i;
+    }
+}
+
+
+// io61_iov_slice(v, iov, iovcnt, off)
+//    Copy the segments `iov[0..iovcnt)`, starting `off` characters into
+//    `iov[0]`, into `v`, which has room for `io61_iov_max` segments.
+//    Returns the number of segments copied.
+
+static int io61_iov_slice(struct iovec* v, const struct iovec* iov,
+                          int iovcnt, size_t off) {
+    int n = std::min(iovcnt, io61_iov_max);
+    for (int i = 0; i != n; ++i) {
+        v[i] = iov[i];
+    }
+    if (n > 0) {
+        v[0].iov_base = (unsigned char*) v[0].iov_base + off;
+        v[0].iov_len -= off;
+    }
+    return n;
+}
+
+
+// io61_read_direct(f, iov, iovcnt)
+//    Read characters at `f->pos_tag` straight into the `iovcnt`
+//    segments of `iov` (at most `io61_iov_max`); the cache must hold
+//    nothing at `f->pos_tag`. A streaming file reads the following bytes
+//    into its cache with the same readv(2). Returns the number of
+//    characters read into `iov`, 0 at end of file, or -1 on error.
+
+static ssize_t io61_read_direct(io61_file* f, const struct iovec* iov,
+                                int iovcnt) {
+    // io_uring files read into the first segment only
+    int i = 0;
+    size_t off = 0;
+    io61_iov_skip(iov, iovcnt, i, off, 0);
+    unsigned char* first = (unsigned char*) iov[i].iov_base;
+
+    // Block-cached files read from any offset; their cache stays valid
+    if (!f->slots.empty()) {
+        ssize_t n;
+        if (f->uring) {
+            n = io61_uring_io(f, IORING_OP_READ, first, iov[i].iov_len,
+                              f->pos_tag);
+        } else {
+            n = preadv(f->fd, iov, iovcnt, f->pos_tag);
+            io61_count_read(f->stats, n);
+        }
+        if (n > 0) {
+            f->pos_tag += n;
+        }
+        return n;
+    }
+
+    io61_flush_pair(f);
+    io61_pool_get(f);
+    size_t sz;
+    ssize_t n;
+    if (f->uring) {
+        sz = iov[i].iov_len;
+        n = io61_uring_io(f, IORING_OP_READ, first, sz, -1);
+    } else {
+        struct iovec v[io61_iov_max + 1];
+        std::copy(iov, iov + iovcnt, v);
+        v[iovcnt] = {f->cbuf, (size_t) f->bufsize};
+        sz = io61_iov_total(iov, iovcnt);
+        n = readv(f->fd, v, iovcnt + 1);
+        io61_count_read(f->stats, n);
+    }
+    if (n < 0) {
+        return -1;
+    }
+    // The file position is now at `pos_tag + n`
+    f->buf = f->cbuf;
+    f->tag = f->pos_tag + std::min((size_t) n, sz);
+    f->end_tag = f->pos_tag + n;
+    f->pos_tag = f->tag;
+    return std::min((size_t) n, sz);
+}
+
+
+// io61_readv(f, iov, iovcnt)
+//    Read into the `iovcnt` segments of `iov` in order, like io61_read
+//    into one buffer of their total length: returns the number of
+//    characters read, which is short only at end of file, or -1 if an
+//    error occurred before any characters were read. Cached characters
+//    are copied into all segments in one pass, and segments that bypass
+//    the cache are read with one readv(2).
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    io61_sync(f);
+    size_t remaining = io61_iov_total(iov, iovcnt);
+    size_t pos = 0;
+    int i = 0;
+    size_t off = 0;             // characters read into `iov[i]`
+    while (remaining != 0) {
+        io61_iov_skip(iov, iovcnt, i, off, 0);
+        // Refill the cache if pos_tag reaches the end or is out of bounds
+        if (f->pos_tag >= f->end_tag || f->pos_tag < f->tag) {
+            // Large requests read the rest straight into the segments
+            // (a streaming file only from its file position)
+            if (remaining >= io61_direct_size(f)
+                && (!f->slots.empty() || f->pos_tag == f->end_tag)) {
+                struct iovec v[io61_iov_max];
+                int nv = io61_iov_slice(v, &iov[i], iovcnt - i, off);
+                ssize_t n = io61_read_direct(f, v, nv);
+                if (n == 0) {
+                    break;
+                } else if (n < 0) {
+                    return pos ? pos : -1;
+                }
+                io61_iov_skip(iov, iovcnt, i, off, n);
+                pos += n;
+                remaining -= n;
+                continue;
+            }
+            int n = io61_fill(f);
+            if (n == 0) {
+                break;
+            } else if (n == -1) {
+                return pos ? pos : -1;
+            }
+        } else {
+            ++f->stats.hits;
+        }
+        // Read as many characters as possible until we reach the end of
+        // the cache or the segment
+        size_t read = std::min(iov[i].iov_len - off,
+                               (size_t) (f->end_tag - f->pos_tag));
+        memcpy((unsigned char*) iov[i].iov_base + off,
+               &f->buf[f->pos_tag - f->tag], read);
+        f->pos_tag += read;
+        off += read;
+        pos += read;
+        remaining -= read;
+    }
+    return pos;
+}
+
+
+// io61_read(f, buf, sz)
+//    Read up to `sz` characters from `f` into `buf`. Returns the number of
+//    characters read on success; normally this is `sz`. Returns a short
+//    count, which might be zero, if the file ended before `sz` characters
+//    could be read. Returns -1 if an error occurred before any characters
+//    were read.
+
+ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
+    io61_sync(f);
+    // Reads the cache can serve are one memcpy; everything else goes
+    // through io61_readv
+    if (f->pos_tag >= f->tag && f->pos_tag < f->end_tag
+        && sz <= (size_t) (f->end_tag - f->pos_tag)) {
+        memcpy(buf, &f->buf[f->pos_tag - f->tag], sz);
+        f->pos_tag += sz;
+        ++f->stats.hits;
+        return sz;
+    }
+    struct iovec iov = {buf, sz};
+    return io61_readv(f, &iov, 1);
+}
+
+
+// io61_readc_slow(f)
+//    Read a single (unsigned) character from `f` and return it. Returns EOF
+//    (which is -1) on error or end-of-file. Called by io61_readc when the
+//    cursor is used up; afterwards, the rest of the cache is read inline.
+
+int io61_readc_slow(io61_file* f) {
+    io61_sync(f);
+    // Refill the cache if pos_tag reaches the limit or is out of bounds
+    if (f->pos_tag >= f->end_tag || f->pos_tag < f->tag) {
+        int n = io61_fill(f);
+        if (n <= 0) {
+            // If there was an error or we reached EOF, return -1
+            return -1;
+        }
+    } else {
+        ++f->stats.hits;
+    }
+    // Then read the character and update the position to the next character
+    unsigned char ch = f->buf[f->pos_tag - f->tag];
+    f->pos_tag++;
+    f->cur.rpos = &f->buf[f->pos_tag - f->tag];
+    f->cur.rend = &f->buf[f->end_tag - f->tag];
+    return ch;
+}
+
+
+// io61_pread_fill(f, s, block_tag, guard)
+//    Read the block at `block_tag` into slot `s` of `f` for io61_pread.
+//    `guard` holds `f->plock`. The slot is installed and marked
+//    `filling` under the lock, so other threads wait for it instead of
+//    reading the block again; the read itself runs with the lock
+//    released. (io_uring reads keep the lock, since the ring isn't
+//    thread-safe.) Returns 0 on success and -1 on error.
+
+static int io61_pread_fill(io61_file* f, io61_slot* s, off_t block_tag,
+                           std::unique_lock<std::mutex>& guard) {
+    if (io61_slot_reuse(f, s) < 0) {
+        return -1;
+    }
+    ++f->stats.refills;
+    s->tag = s->end_tag = block_tag;
+    s->lru = ++f->lru_clock;
+    s->filling = true;
+    ++f->pfilling;
+
+    ssize_t n;
+    if (f->uring) {
+        n = io61_uring_io(f, IORING_OP_READ, s->buf, f->blocksize,
+                          block_tag);
+    } else {
+        guard.unlock();
+        do {
+            n = pread(f->fd, s->buf, f->blocksize, block_tag);
+        } while (n < 0 && errno == EINTR);
+        int err = errno;
+        guard.lock();
+        io61_count_read(f->stats, n);
+        if (n < 0 && err == EINVAL && f->direct) {
+            // The file system rejects O_DIRECT
+            io61_direct_off(f);
+            n = pread(f->fd, s->buf, f->blocksize, block_tag);
+            io61_count_read(f->stats, n);
+            err = errno;
+        }
+        errno = err;
+    }
+
+    if (n < 0) {
+        s->tag = s->end_tag = -1;
+    } else {
+        s->end_tag = block_tag + n;
+    }
+    s->filling = false;
+    --f->pfilling;
+    f->pfilled.notify_all();
+    return n < 0 ? -1 : 0;
+}
+
+
+// io61_pread(f, buf, sz, off)
+//    Read up to `sz` characters at file offset `off` of `f` into `buf`,
+//    like pread(2): the file position of `f` doesn't move. Returns the
+//    number of characters read, which is short only at end of file, or
+//    -1 if an error occurred before any were read. Mapped files copy
+//    from the mapping, and block-cached files read through the cache,
+//    sharing its blocks with io61_read; other seekable readers use
+//    pread(2).
+//
+//    Any number of threads may call io61_pread and io61_pwrite on `f`
+//    at once. Mapped reads need no lock. The rest take `f->plock` only
+//    to look up and install cache blocks and to copy out of them: a
+//    miss marks its slot `filling` and reads it with the lock released,
+//    and threads that want that slot wait for the read (see
+//    io61_pread_fill). Uncached reads run unlocked too. Other functions
+//    still need the file to themselves. Fails for write-only and
+//    compressed files.
+
+ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz, off_t off) {
+    if (f->mode == O_WRONLY || f->z || off < 0) {
+        errno = EINVAL;
+        return -1;
+    } else if (f->map) {
+        if ((size_t) off >= f->map_size) {
+            return 0;
+        }
+        size_t n = std::min(sz, f->map_size - off);
+        memcpy(buf, &f->map[off], n);
+        return n;
+    }
+
+    std::unique_lock<std::mutex> guard(f->plock);
+    io61_sync(f);
+    size_t pos = 0;
+    off_t filled = -1;          // block this call last read
+    while (pos < sz) {
+        off_t p = off + pos;
+        ssize_t n;
+        if (f->slots.empty()) {
+            guard.unlock();
+            n = pread(f->fd, &buf[pos], sz - pos, p);
+            int err = errno;
+            guard.lock();
+            io61_count_read(f->stats, n);
+            if (n < 0 && err == EINTR) {
+                continue;
+            }
+            errno = err;
+            if (n <= 0) {
+                return n < 0 && pos == 0 ? -1 : pos;
+            }
+            pos += n;
+            continue;
+        }
+
+        off_t block_tag = p - p % f->blocksize;
+        io61_slot* victim;
+        io61_slot* s = io61_cache_find(f, block_tag, &victim);
+        if (s ? s->filling : victim->filling) {
+            f->pfilled.wait(guard);
+            continue;
+        }
+        if (!s
+            || (p >= s->end_tag
+                && s->end_tag < block_tag + f->blocksize
+                && f->mode != O_RDWR && block_tag != filled)) {
+            // Miss, or a short block the file may since have filled
+            if (io61_pread_fill(f, s ? s : victim, block_tag, guard) < 0) {
+                return pos == 0 ? -1 : pos;
+            }
+            filled = block_tag;
+            continue;
+        } else if (p >= s->end_tag && f->mode != O_RDWR) {
+            // End of file
+            return pos;
+        }
+
+        // Copy from the block; a block this call just read isn't a hit
+        if (block_tag != filled) {
+            ++f->stats.hits;
+        }
+        io61_page_extend(f, s, p);
+        s->lru = ++f->lru_clock;
+        n = std::max(s->end_tag - p, (off_t) 0);
+        n = std::min((size_t) n, sz - pos);
+        memcpy(&buf[pos], &s->buf[p - s->tag], n);
+        if (n == 0) {
+            return pos;
+        }
+        pos += n;
+    }
+    return pos;
+}
+
+
+// io61_pwritev_all(f, iov, iovcnt, off)
+//    Write the `iovcnt` segments of `iov` (at most `io61_iov_max`) to `f`
+//    at file offset `off`, retrying short writes. Returns the number of
+//    characters written, which is short only on error.
+
+static size_t io61_pwritev_all(io61_file* f, struct iovec* iov, int iovcnt,
+                               off_t off) {
+    size_t total = io61_iov_total(iov, iovcnt);
+    size_t done = 0;
+    int i = 0;
+    size_t ioff = 0;
+    while (done != total) {
+        io61_iov_skip(iov, iovcnt, i, ioff, 0);
+        struct iovec first = iov[i];
+        iov[i].iov_base = (unsigned char*) iov[i].iov_base + ioff;
+        iov[i].iov_len -= ioff;
+        ssize_t w = pwritev(f->fd, &iov[i], iovcnt - i, off + done);
+        io61_count_write(f->stats, w);
+        iov[i] = first;
+        if (w > 0) {
+            io61_iov_skip(iov, iovcnt, i, ioff, w);
+            done += w;
+        } else if (w == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    return done;
+}
+
+
+// io61_dirty_add(f, off, data, len)
+//    Record `len` characters from `data` as dirty at file offset `off`,
+//    overwriting any dirty characters already there. Characters that
+//    continue an extent are appended to it; others start new extents.
+
+static void io61_dirty_add(io61_file* f, off_t off, const unsigned char* data,
+                           size_t len) {
+    off_t end = off + len;
+    // Start with the extent containing `off` or ending right at it
+    auto it = f->dirty->upper_bound(off);
+    if (it != f->dirty->begin()
+        && std::prev(it)->first + (off_t) std::prev(it)->second.size() >= off) {
+        --it;
+    }
+
+    while (off < end) {
+        if (it == f->dirty->end() || it->first > off) {
+            // Fill the gap before the next extent with a new extent
+            off_t gap_end = it == f->dirty->end() ? end
+                : std::min(end, it->first);
+            it = f->dirty->emplace_hint(it, off,
+                std::vector<unsigned char>(data, data + (gap_end - off)));
+            f->dirty_bytes += gap_end - off;
+            data += gap_end - off;
+            off = gap_end;
+        } else {
+            // Overwrite the overlap with `it`, then extend `it` up to the
+            // next extent
+            std::vector<unsigned char>& v = it->second;
+            off_t n = std::min(end, it->first + (off_t) v.size()) - off;
+            memcpy(v.data() + (off - it->first), data, n);
+            data += n;
+            off += n;
+            auto next = std::next(it);
+            off_t grow_end = next == f->dirty->end() ? end
+                : std::min(end, next->first);
+            if (off < grow_end) {
+                v.insert(v.end(), data, data + (grow_end - off));
+                f->dirty_bytes += grow_end - off;
+                data += grow_end - off;
+                off = grow_end;
+            }
+        }
+        ++it;
+    }
+}
+
+
+// io61_dirty_flush(f)
+//    Write back the cache and all dirty extents of the positional writer
+//    `f`, in offset order. Each run of adjacent extents is written by
+//    one pwritev(2). Returns 0 on success and -1 on error; dirty data is
+//    discarded either way.
+
+static int io61_dirty_flush(io61_file* f) {
+    io61_dirty_add(f, f->tag, f->buf, f->end_tag - f->tag);
+    f->tag = f->end_tag = f->pos_tag;
+
+    int r = 0;
+    auto it = f->dirty->begin();
+    while (it != f->dirty->end() && r == 0) {
+        struct iovec iov[io61_iov_max];
+        int n = 0;
+        off_t off = it->first, end = off;
+        while (it != f->dirty->end() && it->first == end
+               && n != io61_iov_max) {
+            iov[n++] = {it->second.data(), it->second.size()};
+            end += it->second.size();
+            ++it;
+        }
+        if (io61_pwritev_all(f, iov, n, off) != (size_t) (end - off)) {
+            r = -1;
+        }
+    }
+    f->dirty->clear();
+    f->dirty_bytes = 0;
+    return r;
+}
+
+
+// io61_dirty_full(f)
+//    Return true if the dirty extents of `f` should be written back.
+
+static bool io61_dirty_full(io61_file* f) {
+    return f->dirty_bytes > io61_dirty_max
+        || f->dirty->size() > io61_dirty_max_extents;
+}
+
+
+// io61_dirty_spill(f)
+//    Make room in the full cache of the positional writer `f`. With no
+//    dirty extents, the cache is written directly; otherwise it becomes
+//    dirty too, so writes reach the file in order. Returns -1 on error.
+
+static int io61_dirty_spill(io61_file* f) {
+    if (f->dirty->empty()) {
+        struct iovec iov = {f->buf, (size_t) (f->end_tag - f->tag)};
+        if (io61_pwritev_all(f, &iov, 1, f->tag) != iov.iov_len) {
+            return -1;
+        }
+    } else {
+        io61_dirty_add(f, f->tag, f->buf, f->end_tag - f->tag);
+    }
+    f->tag = f->end_tag;
+    if (io61_dirty_full(f)) {
+        return io61_dirty_flush(f);
+    }
+    return 0;
+}
+
+
+// io61_dirty_write(f, iov, iovcnt)
+//    Write the cache of the positional writer `f` followed by the
+//    `iovcnt` segments of `iov` (at most `io61_iov_max`). Unless that is
+//    too much to keep, it all becomes dirty. Returns the number of
+//    characters written from `iov`, or -1 on error.
+
+static ssize_t io61_dirty_write(io61_file* f, const struct iovec* iov,
+                                int iovcnt) {
+    size_t total = io61_iov_total(iov, iovcnt);
+    if (f->dirty_bytes + (f->end_tag - f->tag) + total <= io61_dirty_max) {
+        io61_dirty_add(f, f->tag, f->buf, f->end_tag - f->tag);
+        off_t off = f->end_tag;
+        for (int i = 0; i != iovcnt; ++i) {
+            io61_dirty_add(f, off, (const unsigned char*) iov[i].iov_base,
+                           iov[i].iov_len);
+            off += iov[i].iov_len;
+        }
+        f->tag = f->end_tag = f->pos_tag = off;
+        if (io61_dirty_full(f) && io61_dirty_flush(f) < 0) {
+            return -1;
+        }
+        return total;
+    }
+
+    // Too large: write back everything dirty, then `iov` directly
+    if (io61_dirty_flush(f) < 0) {
+        return -1;
+    }
+    struct iovec v[io61_iov_max];
+    std::copy(iov, iov + iovcnt, v);
+    size_t done = io61_pwritev_all(f, v, iovcnt, f->pos_tag);
+    f->tag = f->end_tag = f->pos_tag = f->pos_tag + done;
+    return done ? done : -1;
+}
+
+
+// io61_getdelim(f, line, delim)
+//    Read a line ending in the character `delim` from `f`. Sets `*line`
+//    to the line's characters and returns its length, including the
+//    delimiter; the last line of a file might lack the delimiter.
+//    Returns 0 at end of file, or -1 if an error occurred before any
+//    characters were read. `*line` stays valid until the next call on
+//    `f`.
+//
+//    A line already in the cache is returned in place, with no copy.
+//    A line that spans refills is assembled in `f->linebuf`, which grows
+//    by doubling, so long lines take linear time.
+
+ssize_t io61_getdelim(io61_file* f, const unsigned char** line, int delim) {
+    io61_sync(f);
+    if (f->mode == O_WRONLY) {
+        return -1;
+    }
+    f->linebuf.clear();
+    while (true) {
+        if (f->pos_tag >= f->end_tag || f->pos_tag < f->tag) {
+            int n = io61_fill(f);
+            if (n == 0 || (n < 0 && !f->linebuf.empty())) {
+                break;
+            } else if (n < 0) {
+                return -1;
+            }
+        } else {
+            ++f->stats.hits;
+        }
+
+        const unsigned char* p = &f->buf[f->pos_tag - f->tag];
+        size_t avail = f->end_tag - f->pos_tag;
+        const unsigned char* nl =
+            (const unsigned char*) memchr(p, delim, avail);
+        size_t len = nl ? nl + 1 - p : avail;
+        f->pos_tag += len;
+        if (nl && f->linebuf.empty()) {
+            // The whole line is in the cache, which must stay put
+            f->pool_pin = true;
+            *line = p;
+            return len;
+        }
+        f->linebuf.insert(f->linebuf.end(), p, p + len);
+        if (nl) {
+            break;
+        }
+    }
+    *line = f->linebuf.data();
+    return f->linebuf.size();
+}
+
+
+// io61_readline(f, line)
+//    Read a line ending in '\n' from `f`. Same as
+//    `io61_getdelim(f, line, '\n')`.
+
+ssize_t io61_readline(io61_file* f, const unsigned char** line) {
+    return io61_getdelim(f, line, '\n');
+}
+
+
+// io61_page_pwrite(f, data, sz, off, last)
+//    Write `sz` characters from `data` at file offset `off` into the
+//    page cache of the read/write file `f`, marking the pages dirty. A
+//    page is read first unless the write covers all of it. Sets `*last`
+//    to the slot of the last page written. Returns the number of
+//    characters written, or -1 if an error occurred before any were
+//    written.
+
+static ssize_t io61_page_pwrite(io61_file* f, const unsigned char* data,
+                                size_t sz, off_t off, io61_slot** last) {
+    if (f->slots.empty()) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    size_t pos = 0;
+    while (pos < sz) {
+        off_t p = off + pos;
+        off_t block_tag = p - p % f->blocksize;
+        size_t boff = p - block_tag;
+        size_t n = std::min(sz - pos, (size_t) f->blocksize - boff);
+        io61_slot* victim;
+        io61_slot* s = io61_cache_find(f, block_tag, &victim);
+        if (!s && n == (size_t) f->blocksize) {
+            // Overwriting a whole page: no need to read it
+            if (io61_slot_reuse(f, victim) < 0) {
+                return pos ? pos : -1;
+            }
+            s = victim;
+            s->tag = s->end_tag = block_tag;
+        } else if (!s) {
+            s = io61_cache_load(f, block_tag, victim);
+            if (!s) {
+                return pos ? pos : -1;
+            }
+        }
+
+        // Anything between the page's data and the write is a hole
+        if (s->end_tag < p) {
+            memset(&s->buf[s->end_tag - block_tag], 0, p - s->end_tag);
+        }
+        memcpy(&s->buf[boff], &data[pos], n);
+        s->end_tag = std::max(s->end_tag, (off_t) (p + n));
+        s->dirty = true;
+        s->lru = ++f->lru_clock;
+        f->size = std::max(f->size, (off_t) (p + n));
+        pos += n;
+        *last = s;
+    }
+    return pos;
+}
+
+
+// io61_page_write(f, data, sz)
+//    Write `sz` characters from `data` at `f->pos_tag` into the page
+//    cache of the read/write file `f` (see io61_page_pwrite). Reads
+//    continue from the page written last.
+
+static ssize_t io61_page_write(io61_file* f, const unsigned char* data,
+                               size_t sz) {
+    io61_slot* s = nullptr;
+    ssize_t n = io61_page_pwrite(f, data, sz, f->pos_tag, &s);
+    if (n > 0) {
+        f->pos_tag += n;
+        f->buf = s->buf;
+        f->tag = s->tag;
+        f->end_tag = s->end_tag;
+    }
+    return n;
+}
+
+
+// io61_page_flush(f)
+//    Write back the dirty pages of the read/write file `f` in offset
+//    order. Each run of adjacent pages is written by one pwritev(2).
+//    Returns 0 on success and -1 on error.
+
+static int io61_page_flush(io61_file* f) {
+    std::vector<io61_slot*> dirty;
+    for (auto& s : f->slots) {
+        if (s.dirty) {
+            dirty.push_back(&s);
+        }
+    }
+    std::sort(dirty.begin(), dirty.end(), [] (io61_slot* a, io61_slot* b) {
+        return a->tag < b->tag;
+    });
+
+    int r = 0;
+    size_t i = 0;
+    while (i != dirty.size()) {
+        struct iovec iov[io61_iov_max];
+        int n = 0;
+        off_t off = dirty[i]->tag, end = off;
+        while (i != dirty.size() && dirty[i]->tag == end
+               && n != io61_iov_max) {
+            iov[n++] = {dirty[i]->buf, (size_t) (dirty[i]->end_tag - end)};
+            end = dirty[i]->end_tag;
+            dirty[i]->dirty = false;
+            ++i;
+        }
+        if (io61_pwritev_all(f, iov, n, off) != (size_t) (end - off)) {
+            r = -1;
+        }
+    }
+    return r;
+}
+
+
+// io61_write_policy(f)
+//    Apply the flush policy of `f` after a write call: a latency writer
+//    flushes every time, and an adaptive writer once its oldest pending
+//    output has waited `io61_flush_deadline`. Throughput writers never
+//    flush here. Also notes when output became pending, for
+//    io61_flush_pair.
+
+static void io61_write_policy(io61_file* f) {
+    if (f->flush_policy == IO61_FLUSH_LATENCY) {
+        io61_flush(f);
+        return;
+    } else if (f->flush_policy == IO61_FLUSH_THROUGHPUT && !f->pair) {
+        return;
+    }
+    long long now = io61_now();
+    if (f->pending_ns < 0) {
+        f->pending_ns = now;
+    }
+    if (f->flush_policy == IO61_FLUSH_ADAPTIVE
+        && now - f->pending_ns >= io61_flush_deadline) {
+        io61_flush(f);
+    }
+}
+
+
+// io61_spill(f)
+//    Make room in the full write cache of `f`: hand it to the
+//    write-behind thread, the dirty extents, or the io_uring batch, or
+//    flush it. Returns -1 on error.
+
+static int io61_spill(io61_file* f) {
+    if (f->async) {
+        return io61_async_submit(f);
+    } else if (f->positional) {
+        return io61_dirty_spill(f);
+    } else if (f->uring) {
+        return io61_uring_queue(f);
+    } else {
+        return io61_flush(f);
+    }
+}
+
+
+// io61_zero(data, len)
+//    Return true if the `len` characters at `data` are all zero.
+
+static bool io61_zero(const unsigned char* data, size_t len) {
+    return len == 0
+        || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+
+// io61_sparse_hole(f, off, data, at, len)
+//    Return the length of the zero block at `data[at]`, which is at file
+//    offset `off + at`, if it can be left as a hole in the sparse file
+//    `f`, or 0 if not. It must lie past the end of the file, and be a
+//    whole aligned block, or the part of one at either end of `data`,
+//    since the write before or after may supply the rest.
+
+static size_t io61_sparse_hole(io61_file* f, off_t off,
+                               const unsigned char* data, size_t at,
+                               size_t len) {
+    off_t fo = off + at;
+    if (at == len || fo < f->size
+        || (fo % io61_sparse_block != 0 && at != 0)) {
+        return 0;
+    }
+    size_t n = std::min(len - at, (size_t) (io61_sparse_block
+                                            - fo % io61_sparse_block));
+    if ((n == (size_t) io61_sparse_block || at == 0 || at + n == len)
+        && io61_zero(&data[at], n)) {
+        return n;
+    }
+    return 0;
+}
+
+
+// io61_write_sparse(f, off, data, len)
+//    Write `len` characters from `data` to the sparse file `f` at its
+//    file position, which is `off`. Zero blocks past the end of the file
+//    (see io61_sparse_hole) are skipped with lseek(2) rather than
+//    written, so they become holes; io61_sparse_finish extends the file
+//    over a hole at its end. Returns the number of characters written
+//    or skipped, or -1 if an error occurred before any were.
+
+static ssize_t io61_write_sparse(io61_file* f, off_t off,
+                                 const unsigned char* data, size_t len) {
+    size_t done = 0;
+    while (done != len) {
+        // Measure the zero blocks here, or else the data up to the next
+        // zero block
+        size_t n = 0, k;
+        while ((k = io61_sparse_hole(f, off, data, done + n, len)) != 0) {
+            n += k;
+        }
+        if (n != 0) {
+            if (io61_lseek(f, n, SEEK_CUR) < 0) {
+                return done ? done : -1;
+            }
+            done += n;
+            continue;
+        }
+        n = std::min(len - done, (size_t) (io61_sparse_block
+                                           - (off + done) % io61_sparse_block));
+        while (done + n != len
+               && io61_sparse_hole(f, off, data, done + n, len) == 0) {
+            n = std::min(len - done, n + io61_sparse_block);
+        }
+        ssize_t w = write(f->fd, &data[done], n);
+        io61_count_write(f->stats, w);
+        if (w > 0) {
+            done += w;
+            f->size = std::max(f->size, off + (off_t) done);
+        } else if (w == 0 || errno != EINTR) {
+            return done ? done : -1;
+        }
+    }
+    return done;
+}
+
+
+// io61_sparse_finish(f)
+//    Extend the sparse file `f` to its file position, `f->tag`, if its
+//    last blocks were skipped. Returns 0 on success and -1 on error.
+
+static int io61_sparse_finish(io61_file* f) {
+    if (f->tag > f->size) {
+        if (ftruncate(f->fd, f->tag) < 0) {
+            return -1;
+        }
+        f->size = f->tag;
+    }
+    return 0;
+}
+
+
+// io61_shared_out(f, iov, iovcnt)
+//    Write the `iovcnt` segments of `iov` to the shared file `f`, which
+//    only the writer sealing a buffer does. Returns false on error.
+
+static bool io61_shared_out(io61_file* f, const struct iovec* iov,
+                            int iovcnt) {
+    for (int i = 0; i != iovcnt; ++i) {
+        const unsigned char* data = (const unsigned char*) iov[i].iov_base;
+        size_t done = 0;
+        while (done != iov[i].iov_len) {
+            ssize_t w;
+            if (f->sparse) {
+                w = io61_write_sparse(f, f->tag, &data[done],
+                                      iov[i].iov_len - done);
+            } else {
+                w = write(f->fd, &data[done], iov[i].iov_len - done);
+                io61_count_write(f->stats, w);
+            }
+            if (w > 0) {
+                done += w;
+                f->tag += w;
+            } else if (w == 0 || errno != EINTR) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+// io61_shared_seal(f, len, iov, iovcnt)
+//    Seal the current buffer of the shared file `f`, which holds `len`
+//    reserved characters, on behalf of a writer of the `iovcnt` segments
+//    of `iov` that don't fit in it. Returns the number of characters
+//    written from `iov`, or -1 on error.
+
+static ssize_t io61_shared_seal(io61_file* f, size_t len,
+                                const struct iovec* iov, int iovcnt) {
+    io61_shared* sh = f->shared;
+    // Wait for the reservations before ours to be copied in
+    while (sh->done.load(std::memory_order_acquire) != len) {
+        std::this_thread::yield();
+    }
+    struct iovec v = {sh->buf, len};
+    bool ok = io61_shared_out(f, &v, 1);
+
+    // Our characters start the next buffer, if they fit
+    size_t total = io61_iov_total(iov, iovcnt);
+    size_t next = 0;
+    if (ok && total <= sh->cap) {
+        for (int i = 0; i != iovcnt; ++i) {
+            memcpy(&sh->buf[next], iov[i].iov_base, iov[i].iov_len);
+            next += iov[i].iov_len;
+        }
+    } else if (ok) {
+        ok = io61_shared_out(f, iov, iovcnt);
+    }
+    if (iovcnt == 0) {
+        ++f->stats.flushes;
+        ok = ok && (!f->sparse || io61_sparse_finish(f) >= 0);
+    }
+    f->end_tag = f->pos_tag = f->tag;
+    if (!ok) {
+        sh->err = true;
+    }
+
+    sh->done.store(next, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> guard(sh->m);
+        uint64_t gen = (sh->word.load() >> io61_shared_bits) + 1;
+        sh->word.store(gen << io61_shared_bits | next,
+                       std::memory_order_release);
+    }
+    sh->wake.notify_all();
+    return ok ? total : -1;
+}
+
+
+// io61_shared_writev(f, iov, iovcnt)
+//    Write the `iovcnt` segments of `iov` to the shared file `f` as one
+//    run of characters. With `iovcnt == 0`, seals the current buffer
+//    unless another writer is sealing it already (see io61_flush).
+//    Returns the number of characters written, or -1 on error.
+
+static ssize_t io61_shared_writev(io61_file* f, const struct iovec* iov,
+                                  int iovcnt) {
+    io61_shared* sh = f->shared;
+    const uint64_t mask = ((uint64_t) 1 << io61_shared_bits) - 1;
+    size_t total = io61_iov_total(iov, iovcnt);
+    if (total == 0 && iovcnt != 0) {
+        return 0;
+    }
+    // Reserving more than the buffer holds guarantees a seal
+    size_t want = iovcnt == 0 ? sh->cap + 1 : std::min(total, sh->cap + 1);
+    while (true) {
+        uint64_t w = sh->word.fetch_add(want, std::memory_order_acq_rel);
+        size_t off = w & mask;
+        if (off + want <= sh->cap) {
+            for (int i = 0; i != iovcnt; ++i) {
+                memcpy(&sh->buf[off], iov[i].iov_base, iov[i].iov_len);
+                off += iov[i].iov_len;
+            }
+            sh->done.fetch_add(total, std::memory_order_release);
+            return total;
+        } else if (off <= sh->cap) {
+            return io61_shared_seal(f, off, iov, iovcnt);
+        }
+
+        // Another writer is sealing the buffer
+        std::unique_lock<std::mutex> guard(sh->m);
+        while (sh->word.load() >> io61_shared_bits == w >> io61_shared_bits) {
+            sh->wake.wait(guard);
+        }
+        if (iovcnt == 0) {
+            return 0;
+        }
+    }
+}
+
+
+// io61_map_reserve(f, end)
+//    Make the mapping of the mapped writer `f` reach file offset `end`,
+//    extending the file and doubling the mapping as needed. Returns 0 on
+//    success and -1 on error.
+
+static int io61_map_reserve(io61_file* f, off_t end) {
+    if ((size_t) end <= f->map_size) {
+        return 0;
+    }
+    size_t size = std::max((size_t) end, 2 * f->map_size);
+    if (ftruncate(f->fd, size) < 0) {
+        return -1;
+    }
+    void* p = mremap(f->map, f->map_size, size, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED) {
         return -1;
     }
+    f->map = f->buf = (unsigned char*) p;
+    f->map_size = size;
+    return 0;
 }
 
 
-// io61_read(f, buf, sz)
-//    Read up to `sz` characters from `f` into `buf`. Returns the number of
-//    characters read on success; normally this is `sz`. Returns a short
-//    count, which might be zero, if the file ended before `sz` characters
-//    could be read. Returns -1 if an error occurred before any characters
-//    were read.
+// io61_map_write(f, iov, iovcnt)
+//    Copy the `iovcnt` segments of `iov` into the mapping of the mapped
+//    writer `f` at `f->pos_tag`. Returns the number of characters
+//    written, or -1 on error.
 
-ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
-    size_t pos = 0;
-    while (pos < sz) {
-        // Refill the cache if pos_tag reaches the end or is out of bounds
-        if (f->pos_tag >= f->end_tag || f->pos_tag < f->tag) {
-            int n = io61_fill(f);
-            if (n == 0) {
-                break;
-            } else if (n == -1) {
-                return -1;
-            }
-        }
-        // Read as many characters as possible until we reach the end of the cache or hit sz
-        size_t read = std::min(sz - pos, (size_t) (f->end_tag - f->pos_tag));
-        memcpy(&buf[pos], &f->cbuf[f->pos_tag - f->tag], read);
-        f->pos_tag += read;
-        pos += read;
+static ssize_t io61_map_write(io61_file* f, const struct iovec* iov,
+                              int iovcnt) {
+    size_t total = io61_iov_total(iov, iovcnt);
+    if (io61_map_reserve(f, f->pos_tag + total) < 0) {
+        return -1;
     }
-    return pos;
+    for (int i = 0; i != iovcnt; ++i) {
+        memcpy(&f->map[f->pos_tag], iov[i].iov_base, iov[i].iov_len);
+        f->pos_tag += iov[i].iov_len;
+    }
+    f->end_tag = f->pos_tag;
+    f->size = std::max(f->size, f->pos_tag);
+    return total;
 }
 
 
-// io61_readc(f)
-//    Read a single (unsigned) character from `f` and return it. Returns EOF
-//    (which is -1) on error or end-of-file.
+// io61_write_direct(f, iov, iovcnt)
+//    Write the cached characters of `f` followed by the `iovcnt`
+//    segments of `iov` (at most `io61_iov_max`), with writev(2) when
+//    possible. A sparse file writes one segment at a time, looking for
+//    zero blocks in the segments themselves. Returns the number of
+//    characters written from `iov`, or -1 if an error occurred before
+//    any were written.
 
-int io61_readc(io61_file* f) {
-    // Refill the cache if pos_tag reaches the limit or is out of bounds
-    if (f->pos_tag >= f->end_tag || f->pos_tag < f->tag) {
-        int n = io61_fill(f);
-        if (n <= 0) {
-            // If there was an error or we reached EOF, return -1
-            return -1;
+static ssize_t io61_write_direct(io61_file* f, const struct iovec* iov,
+                                 int iovcnt) {
+    if (f->positional) {
+        return io61_dirty_write(f, iov, iovcnt);
+    }
+
+    // io_uring files flush their queued writes first
+    if (f->uring && io61_flush(f) < 0) {
+        return -1;
+    }
+
+    struct iovec v[io61_iov_max + 1];
+    size_t ncached = f->end_tag - f->tag;
+    v[0] = {f->buf, ncached};
+    std::copy(iov, iov + iovcnt, v + 1);
+    size_t total = ncached + io61_iov_total(iov, iovcnt);
+
+    size_t done = 0;
+    int i = 0;
+    size_t off = 0;
+    while (done != total) {
+        io61_iov_skip(v, iovcnt + 1, i, off, 0);
+        ssize_t w;
+        if (f->uring) {
+            w = io61_uring_io(f, IORING_OP_WRITE,
+                              (unsigned char*) v[i].iov_base + off,
+                              v[i].iov_len - off, -1);
+        } else if (f->sparse) {
+            w = io61_write_sparse(f, f->tag + done,
+                                  (unsigned char*) v[i].iov_base + off,
+                                  v[i].iov_len - off);
+        } else {
+            struct iovec first = v[i];
+            v[i].iov_base = (unsigned char*) v[i].iov_base + off;
+            v[i].iov_len -= off;
+            w = writev(f->fd, &v[i], iovcnt + 1 - i);
+            io61_count_write(f->stats, w);
+            v[i] = first;
+        }
+        if (w > 0) {
+            io61_iov_skip(v, iovcnt + 1, i, off, w);
+            done += w;
+        } else if (w == 0 || errno != EINTR) {
+            break;
         }
     }
-    // Then read the character and update the position to the next character
-    unsigned char ch = f->cbuf[f->pos_tag - f->tag];
-    f->pos_tag++;
-    return ch;
+
+    if (done < ncached) {
+        // Keep the cached characters that weren't written
+        memmove(f->buf, &f->buf[done], ncached - done);
+        f->tag += done;
+        return -1;
+    }
+    f->tag = f->end_tag = f->pos_tag = f->end_tag + done - ncached;
+    return done > ncached ? done - ncached : -1;
 }
 
 
-// io61_write(f, buf, sz)
-//    Write `sz` characters from `buf` to `f`. Returns the number of
-//    characters written on success; normally this is `sz`. Returns -1 if
-//    an error occurred before any characters were written.
+// io61_writev(f, iov, iovcnt)
+//    Write the `iovcnt` segments of `iov` in order, like io61_write of
+//    one buffer holding their concatenation. Returns the number of
+//    characters written, or -1 if an error occurred before any were
+//    written. Small segments are copied into the cache in one pass, and
+//    the rest of a large request goes out with the cache in one
+//    writev(2).
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    if (f->shared) {
+        return io61_shared_writev(f, iov, iovcnt);
+    }
+    io61_sync(f);
+    if (f->map) {
+        return io61_map_write(f, iov, iovcnt);
+    }
+    // Read/write files write into their page cache
+    if (f->mode == O_RDWR) {
+        size_t pos = 0;
+        for (int i = 0; i != iovcnt; ++i) {
+            ssize_t n = io61_page_write(f,
+                                        (const unsigned char*) iov[i].iov_base,
+                                        iov[i].iov_len);
+            if (n < 0) {
+                return pos ? pos : -1;
+            }
+            pos += n;
+            if ((size_t) n != iov[i].iov_len) {
+                break;
+            }
+        }
+        return pos;
+    }
 
-ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
     // If pos_tag is out of bounds, reset the cache
-    if (f->pos_tag < f->tag || f->pos_tag > f->tag + f->bufsize) {
+    if (f->pos_tag < f->tag || f->pos_tag > f->tag + f->bufcap) {
         f->tag = f->end_tag = f->pos_tag;
     }
+    io61_pool_get(f);
 
+    size_t remaining = io61_iov_total(iov, iovcnt);
     size_t pos = 0;
-    while (pos < sz) {
-        // Flush the cache if it is full
-        if (f->end_tag == f->tag + f->bufsize) {
-            int n = io61_flush(f);
+    int i = 0;
+    size_t off = 0;             // characters written from `iov[i]`
+    while (remaining != 0) {
+        io61_iov_skip(iov, iovcnt, i, off, 0);
+        // Large requests write the cache and the rest directly
+        if (remaining >= io61_direct_size(f)) {
+            struct iovec v[io61_iov_max];
+            int nv = io61_iov_slice(v, &iov[i], iovcnt - i, off);
+            ssize_t n = io61_write_direct(f, v, nv);
             if (n < 0) {
-                return -1;
+                return pos ? pos : -1;
+            }
+            io61_iov_skip(iov, iovcnt, i, off, n);
+            pos += n;
+            remaining -= n;
+            if ((size_t) n != io61_iov_total(v, nv)) {
+                break;
+            }
+            continue;
+        }
+        // Make room in the cache if it is full
+        if (f->end_tag == f->tag + f->bufcap) {
+            int n = io61_spill(f);
+            if (n < 0) {
+                return pos ? pos : -1;
             }
         }
-        // Write as many characters as possible until we reach the end of the cache or hit sz
-        size_t write = std::min(sz - pos, (size_t) (f->bufsize - (f->end_tag - f->tag)));
-        memcpy(&f->cbuf[f->pos_tag - f->tag], &buf[pos], write);
+        // Write as many characters as possible until we reach the end of
+        // the cache or the segment
+        size_t write = std::min(iov[i].iov_len - off,
+                                (size_t) (f->bufcap - (f->end_tag - f->tag)));
+        memcpy(&f->buf[f->pos_tag - f->tag],
+               (const unsigned char*) iov[i].iov_base + off, write);
         f->pos_tag += write;
         f->end_tag += write;
+        off += write;
         pos += write;
+        remaining -= write;
     }
+    io61_write_policy(f);
     return pos;
 }
 
 
-// io61_writec(f)
+// io61_write(f, buf, sz)
+//    Write `sz` characters from `buf` to `f`. Returns the number of
+//    characters written on success; normally this is `sz`. Returns -1 if
+//    an error occurred before any characters were written.
+
+ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
+    struct iovec iov = {(unsigned char*) buf, sz};
+    if (f->shared) {
+        return io61_shared_writev(f, &iov, 1);
+    }
+    io61_sync(f);
+    // Writes that fit in the cache, short of filling it, are one
+    // memcpy; everything else goes through io61_writev
+    if (f->mode == O_WRONLY && !f->map && f->buf
+        && f->pos_tag == f->end_tag && f->pos_tag >= f->tag
+        && sz < (size_t) (f->bufcap - (f->end_tag - f->tag))) {
+        memcpy(&f->buf[f->end_tag - f->tag], buf, sz);
+        f->pos_tag = f->end_tag += sz;
+        f->pool_ref = true;
+        io61_write_policy(f);
+        return sz;
+    }
+    return io61_writev(f, &iov, 1);
+}
+
+
+// io61_writec_slow(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
-//    -1 on error.
+//    -1 on error. Called by io61_writec when the cursor is used up;
+//    afterwards, the rest of the cache is written inline, except in
+//    read/write files, whose pages must be marked dirty, and files whose
+//    flush policy must see every write.
 
-int io61_writec(io61_file* f, int ch) {
-    // Flush the cache if it is full
-    if (f->end_tag == f->tag + f->bufsize) {
-        int n = io61_flush(f);
+int io61_writec_slow(io61_file* f, int ch) {
+    if (f->shared) {
+        unsigned char c = ch;
+        struct iovec iov = {&c, 1};
+        return io61_shared_writev(f, &iov, 1) == 1 ? 0 : -1;
+    }
+    io61_sync(f);
+    if (f->mode == O_RDWR) {
+        unsigned char c = ch;
+        return io61_page_write(f, &c, 1) == 1 ? 0 : -1;
+    } else if (f->map) {
+        // Mapped writers write inline up to the end of the mapping
+        if (io61_map_reserve(f, f->pos_tag + 1) < 0) {
+            return -1;
+        }
+        f->map[f->pos_tag] = ch;
+        ++f->pos_tag;
+        f->size = std::max(f->size, f->pos_tag);
+        f->cur.wpos = &f->map[f->pos_tag];
+        f->cur.wend = &f->map[f->map_size];
+        return 0;
+    }
+    io61_pool_get(f);
+
+    // Make room in the cache if it is full
+    if (f->end_tag == f->tag + f->bufcap) {
+        int n = io61_spill(f);
         if (n < 0) {
             return -1;
         }
     }
 
     // If pos_tag is within bounds, cache the character
-    if (f->pos_tag >= f->tag && f->pos_tag <= f->tag + f->bufsize) {
-        f->cbuf[f->end_tag - f->tag] = ch;
+    if (f->pos_tag >= f->tag && f->pos_tag <= f->tag + f->bufcap) {
+        f->buf[f->end_tag - f->tag] = ch;
         f->pos_tag++;
         f->end_tag++;
+        io61_write_policy(f);
+        if (f->flush_policy == IO61_FLUSH_THROUGHPUT) {
+            f->cur.wpos = &f->buf[f->end_tag - f->tag];
+            f->cur.wend = &f->buf[f->bufcap];
+        }
         return 0;
     } else {
         return -1;
@@ -172,18 +4195,211 @@ int io61_writec(io61_file* f, int ch) {
 }
 
 
+// io61_pwrite(f, buf, sz, off)
+//    Write `sz` characters from `buf` at file offset `off` of `f`, like
+//    pwrite(2): the file position of `f` doesn't move. Returns the
+//    number of characters written, or -1 if an error occurred before
+//    any were written. Read/write files write into their page cache,
+//    and mapped writers into the mapping (see io61_setsize). Other
+//    seekable writers become positional, as when they seek, and keep
+//    the characters as dirty extents until io61_flush (see io61_seek);
+//    asynchronous writers instead wait for their queued writes and use
+//    pwrite(2). Threads may share `f` as for io61_pread. Fails for
+//    read-only, compressed, and thread-safe (see io61_setshared) files.
+
+ssize_t io61_pwrite(io61_file* f, const unsigned char* buf, size_t sz,
+                    off_t off) {
+    if (f->mode == O_RDONLY || f->z || f->shared || off < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::unique_lock<std::mutex> guard(f->plock);
+    io61_sync(f);
+    if (f->mode == O_RDWR) {
+        // Pages being read by io61_pread can't be written or evicted
+        f->pfilled.wait(guard, [&] () {
+            return f->pfilling == 0;
+        });
+        io61_slot* s;
+        return io61_page_pwrite(f, buf, sz, off, &s);
+    } else if (f->map) {
+        if (io61_map_reserve(f, off + sz) < 0) {
+            return -1;
+        }
+        memcpy(&f->map[off], buf, sz);
+        f->size = std::max(f->size, (off_t) (off + sz));
+        return sz;
+    } else if (f->async) {
+        if (io61_flush(f) < 0) {
+            return -1;
+        }
+        struct iovec iov = {(unsigned char*) buf, sz};
+        size_t n = io61_pwritev_all(f, &iov, 1, off);
+        return n != 0 || sz == 0 ? n : -1;
+    }
+
+    // Characters already in the cache were written first, so they
+    // become dirty extents first
+    if (!f->positional) {
+        if (io61_lseek(f, 0, SEEK_CUR) < 0 || io61_flush(f) < 0) {
+            return -1;
+        }
+        io61_direct_off(f);
+        f->positional = true;
+        f->sparse = false;
+        if (!f->dirty) {
+            f->dirty = new io61_extents;
+        }
+    } else if (f->end_tag != f->tag) {
+        io61_dirty_add(f, f->tag, f->buf, f->end_tag - f->tag);
+    }
+    f->tag = f->end_tag = f->pos_tag;
+    io61_dirty_add(f, off, buf, sz);
+    if (io61_dirty_full(f) && io61_dirty_flush(f) < 0) {
+        return -1;
+    }
+    return sz;
+}
+
+
+// io61_write_unaligned(f, buf, sz)
+//    Write `sz` characters from `buf` to the O_DIRECT file `f` at its
+//    file position, with O_DIRECT turned off for the call.
+
+static ssize_t io61_write_unaligned(io61_file* f, const unsigned char* buf,
+                                    size_t sz) {
+    int flags = fcntl(f->fd, F_GETFL);
+    fcntl(f->fd, F_SETFL, flags & ~O_DIRECT);
+    ssize_t w = write(f->fd, buf, sz);
+    io61_count_write(f->stats, w);
+    fcntl(f->fd, F_SETFL, flags);
+    return w;
+}
+
+
+// io61_write_aligned(f)
+//    Write the cache of the O_DIRECT file `f`, which starts at file
+//    position `f->tag`. Whole aligned blocks are written directly. An
+//    unaligned head or tail is written without O_DIRECT, and the cache
+//    is shifted after the head so the blocks that follow it are aligned
+//    in memory too. Returns the number of characters written, or -1 on
+//    error.
+
+static ssize_t io61_write_aligned(io61_file* f) {
+    off_t len = f->end_tag - f->tag;
+    off_t head = std::min(len, (io61_direct_align - f->tag % io61_direct_align)
+                          % io61_direct_align);
+    off_t body = (len - head) / io61_direct_align * io61_direct_align;
+    ssize_t w;
+    if (head > 0) {
+        w = io61_write_unaligned(f, f->cbuf, head);
+        if (w != head) {
+            return w;
+        }
+        memmove(f->cbuf, &f->cbuf[head], len - head);
+    }
+    if (body > 0) {
+        w = write(f->fd, f->cbuf, body);
+        io61_count_write(f->stats, w);
+        if (w < 0 && errno == EINVAL) {
+            // The file system rejects O_DIRECT
+            io61_direct_off(f);
+            w = write(f->fd, f->cbuf, body);
+            io61_count_write(f->stats, w);
+        }
+        if (w != body) {
+            return w < 0 && head == 0 ? -1 : head + std::max(w, (ssize_t) 0);
+        }
+    }
+    if (len > head + body) {
+        w = io61_write_unaligned(f, &f->cbuf[body], len - head - body);
+        if (w != len - head - body) {
+            return head + body + std::max(w, (ssize_t) 0);
+        }
+    }
+    return len;
+}
+
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
 //    data buffered for reading, or do nothing.
 
 int io61_flush(io61_file* f) {
+    // Shared files seal their buffer, and report any write that failed
+    // since the last flush
+    if (f->shared) {
+        io61_shared_writev(f, nullptr, 0);
+        return f->shared->err.exchange(false) ? -1 : 0;
+    }
+    io61_sync(f);
+    // Nothing is buffered for writing in read-only files
+    if (f->mode == O_RDONLY) {
+        return 0;
+    }
+    ++f->stats.flushes;
+    f->pending_ns = -1;
+    if (f->mode == O_RDWR) {
+        return io61_page_flush(f);
+    }
+
+    // Write-behind files wait for the thread to write everything
+    if (f->async) {
+        return io61_async_drain(f);
+    }
+
+    // Mapped writers' characters are already in the page cache; only
+    // the file position needs to catch up
+    if (f->map) {
+        return io61_lseek(f, f->pos_tag, SEEK_SET) == f->pos_tag ? 0 : -1;
+    }
+
+    // Positional writers write back dirty extents, then move the file
+    // position to where a sequential writer would have left it
+    if (f->positional) {
+        int r = io61_dirty_flush(f);
+        if (io61_lseek(f, f->pos_tag, SEEK_SET) != f->pos_tag) {
+            r = -1;
+        }
+        return r;
+    }
+
+    // io_uring files submit their queued writes along with this one
+    if (f->uring) {
+        int r = io61_uring_queue(f);
+        return io61_uring_drain(f) < 0 || r < 0 ? -1 : 0;
+    }
+
+    // Compressed files write the cache as one frame
+    if (f->z) {
+        return io61_z_flush(f);
+    }
+
     // Write the contents of the cache
-    int n = write(f->fd, f->cbuf, f->end_tag - f->tag);
+    timespec t0 = {};
+    if (f->adaptive) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    }
+    int n;
+    if (f->direct) {
+        n = io61_write_aligned(f);
+    } else if (f->sparse) {
+        n = io61_write_sparse(f, f->tag, f->cbuf, f->end_tag - f->tag);
+    } else {
+        n = write(f->fd, f->cbuf, f->end_tag - f->tag);
+        io61_count_write(f->stats, n);
+    }
 
     // Reset the cache
     if (n == f->end_tag - f->tag) {
         f->tag = f->pos_tag = f->end_tag;
+        if (f->adaptive) {
+            io61_adapt(f, n, t0);
+        }
+        if (f->sparse && io61_sparse_finish(f) < 0) {
+            return -1;
+        }
         return n;
     } else {
         return -1;
@@ -191,18 +4407,84 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_seek_to(f, pos)
+//    Finish a read-side seek of `f` by moving `f->pos_tag` to `pos`. If
+//    `pos` lies in the cache, the inline cursor is armed there, so the
+//    next io61_readc doesn't leave the fast path. Returns 0.
+
+static int io61_seek_to(io61_file* f, off_t pos) {
+    f->pos_tag = pos;
+    if (pos >= f->tag && pos < f->end_tag) {
+        f->cur.rpos = &f->buf[pos - f->tag];
+        f->cur.rend = &f->buf[f->end_tag - f->tag];
+    }
+    return 0;
+}
+
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t pos) {
+    // A reader whose cursor is armed, seeking within its cache, just
+    // moves the cursor (what io61_sync would count, then io61_seek_to)
+    if (f->cur.rend && pos >= f->tag && pos < f->end_tag) {
+        off_t cur = f->tag + (f->cur.rpos - f->buf);
+        f->stats.hits += cur - f->pos_tag;
+        f->pos_tag = cur;
+        f->pool_pin = false;
+        io61_observe_seek(f, pos);
+        f->pos_tag = pos;
+        f->cur.rpos = &f->buf[pos - f->tag];
+        return 0;
+    }
+    if (f->shared || (f->z && f->mode == O_WRONLY)) {
+        return -1;
+    }
+    io61_sync(f);
+    // Mapped writers just move
+    if (f->mode == O_WRONLY && f->map) {
+        if (pos < 0) {
+            return -1;
+        }
+        f->pos_tag = pos;
+        return 0;
+    }
+
+    // A seekable writer becomes positional: the cache moves to the dirty
+    // extents and writing resumes at `pos`, with no system calls
+    if (f->mode == O_WRONLY
+        && !f->async
+        && pos >= 0
+        && (f->positional || io61_lseek(f, 0, SEEK_CUR) >= 0)) {
+        if (!f->positional) {
+            if (io61_flush(f) < 0) {
+                return -1;
+            }
+            io61_direct_off(f);
+            f->positional = true;
+            f->sparse = false;
+            if (!f->dirty) {
+                f->dirty = new io61_extents;
+            }
+        } else if (f->end_tag != f->tag) {
+            io61_dirty_add(f, f->tag, f->buf, f->end_tag - f->tag);
+            if (io61_dirty_full(f) && io61_dirty_flush(f) < 0) {
+                return -1;
+            }
+        }
+        f->tag = f->end_tag = f->pos_tag = pos;
+        return 0;
+    }
+
     // If the file is write-only, flush the cache and lseek to the new position
     if (f->mode == O_WRONLY) {
         int n = io61_flush(f);
         if (n < 0) {
             return -1;
         }
-        off_t r = lseek(f->fd, pos, SEEK_SET);
+        off_t r = io61_lseek(f, pos, SEEK_SET);
         if (r == pos) {
             return 0;
         } else {
@@ -210,22 +4492,48 @@ int io61_seek(io61_file* f, off_t pos) {
         }
     }
 
+    if (pos < 0) {
+        return -1;
+    }
+    io61_observe_seek(f, pos);
+
+    // Mapped and block-cached files fill lazily from `pos_tag`, so
+    // seeking makes no system calls. Positions past the end of the file
+    // simply read as end-of-file.
+    if (f->map || !f->slots.empty()) {
+        return io61_seek_to(f, pos);
+    }
+
+    // Asynchronous files can seek only if the thread uses pread
+    if (f->async) {
+        if (!f->async->seekable) {
+            return -1;
+        } else if (pos < f->tag || pos >= f->end_tag) {
+            io61_async_seek(f, pos);
+        }
+        return io61_seek_to(f, pos);
+    }
+
+    // Compressed files find the block in their index
+    if (f->z && (pos < f->tag || pos >= f->end_tag)) {
+        return io61_z_seek(f, pos);
+    }
+
     // If the new position is already in the cache, update the pos_tag
     if (pos >= f->tag && pos < f->end_tag) {
-        f->pos_tag = pos;
-        return 0;
+        return io61_seek_to(f, pos);
     } else {
-        // Otherwise, lseek to the nearest multiple of (bufsize) and fill the cache
-        off_t aligned_pos = (pos / f->bufsize) * f->bufsize;
-        off_t r = lseek(f->fd, aligned_pos, SEEK_SET);
+        // Otherwise, lseek to the start of the region we expect to read
+        // next and fill the cache
+        off_t aligned_pos = io61_fill_start(f, pos, f->bufsize);
+        off_t r = io61_lseek(f, aligned_pos, SEEK_SET);
         if (r == aligned_pos) {
             f->end_tag = aligned_pos;
             ssize_t n = io61_fill(f);
             if (n < 0) {
                 return -1;
             }
-            f->pos_tag = pos;
-            return 0;
+            return io61_seek_to(f, pos);
         } else {
             return -1;
         }
@@ -233,6 +4541,328 @@ int io61_seek(io61_file* f, off_t pos) {
 }
 
 
+// io61_copy_kernel(in, out, sz, method)
+//    Copy up to `sz` characters from `in` to `out` inside the kernel
+//    using `method`: 0 for copy_file_range(2), 1 for sendfile(2), 2 for
+//    splice(2). `in` is read at `in->pos_tag` if it reads by offset, and
+//    from its file position otherwise; `out` is written at its file
+//    position. Returns the number of characters copied, 0 at end of
+//    file, or -1 on error.
+
+static ssize_t io61_copy_kernel(io61_file* in, io61_file* out, size_t sz,
+                                int method) {
+    bool positional = in->map || !in->slots.empty();
+    loff_t off = in->pos_tag;
+    if (method == 0) {
+        return copy_file_range(in->fd, positional ? &off : nullptr,
+                               out->fd, nullptr, sz, 0);
+    } else if (method == 1) {
+        off_t soff = in->pos_tag;
+        return sendfile(out->fd, in->fd, positional ? &soff : nullptr, sz);
+    } else {
+        return splice(in->fd, positional ? &off : nullptr,
+                      out->fd, nullptr, sz, SPLICE_F_MOVE);
+    }
+}
+
+
+// io61_copy(in, out, sz)
+//    Copy up to `sz` characters from the read-only file `in` to the
+//    write-only file `out`, stopping early at end of file. Returns the
+//    number of characters copied, or -1 if an error occurred before any
+//    were copied.
+//
+//    Characters already cached in `in` are written to `out` as usual;
+//    `out` is then flushed and the rest is copied by the kernel with
+//    copy_file_range(2), sendfile(2), or splice(2), whichever the file
+//    types support, without passing through user memory (unless `out`
+//    is mapped, since its mapping is its cache). If a seekable `in`
+//    has holes (see io61_hasholes), `out` is made sparse when it can be
+//    (see io61_setsparse); holes in `in` are then skipped and left as
+//    holes in `out`, so copying a sparse file takes time in proportion
+//    to its data. If no method applies (or `in` is asynchronous), the
+//    copy goes through a buffer.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t sz) {
+    io61_sync(in);
+    io61_sync(out);
+    assert(in->mode == O_RDONLY && out->mode == O_WRONLY);
+    size_t pos = 0;
+
+    // Write out the characters cached in `in`, unless it is mapped
+    if (!in->map && in->pos_tag >= in->tag && in->pos_tag < in->end_tag) {
+        size_t n = std::min(sz, (size_t) (in->end_tag - in->pos_tag));
+        in->pool_pin = true;
+        ssize_t w = io61_write(out, &in->buf[in->pos_tag - in->tag], n);
+        in->pool_pin = false;
+        if (w < 0) {
+            return -1;
+        }
+        in->pos_tag += w;
+        pos += w;
+        if ((size_t) w != n) {
+            return pos;
+        }
+    }
+
+    // Copy the rest inside the kernel. A streaming `in` must be at its
+    // file position.
+    bool positional = in->map || !in->slots.empty();
+    if (pos < sz
+        && !in->async
+        && !out->map
+        && !in->z
+        && !out->z
+        && (positional || in->pos_tag == in->end_tag)) {
+        if (io61_flush(out) < 0) {
+            return pos ? pos : -1;
+        }
+        // Holes in `in` stay holes in `out`, if it can be sparse
+        if (!out->sparse && io61_hasholes(in)) {
+            io61_setsparse(out, 1);
+        }
+        int method = 0;
+        bool copied = false;    // current method has copied something
+        while (pos < sz && method < 3) {
+            size_t chunk = std::min(sz - pos, (size_t) 1 << 30);
+            // Holes in `in` become holes in a sparse `out`: the copy
+            // skips them and goes one run of data at a time
+            bool hole;
+            off_t end = positional && out->sparse && out->pos_tag >= out->size
+                ? io61_extent(in, in->pos_tag, hole) : -1;
+            if (end > in->pos_tag) {
+                chunk = std::min(chunk, (size_t) (end - in->pos_tag));
+                if (hole) {
+                    if (io61_lseek(out, chunk, SEEK_CUR) < 0) {
+                        return pos ? pos : -1;
+                    }
+                    in->pos_tag += chunk;
+                    out->pos_tag += chunk;
+                    pos += chunk;
+                    continue;
+                }
+            }
+            ssize_t n = io61_copy_kernel(in, out, chunk, method);
+            io61_count_write(out->stats, n);
+            if (n > 0) {
+                in->stats.bytes_read += n;
+            }
+            if (n > 0) {
+                in->pos_tag += n;
+                out->pos_tag += n;
+                out->size = std::max(out->size, out->pos_tag);
+                pos += n;
+                copied = true;
+            } else if (n == 0 && (copied || method != 0)) {
+                // End of file. (copy_file_range also returns 0 for
+                // special files that report size 0, so those try the
+                // next method.)
+                break;
+            } else if (n < 0 && errno == EINTR) {
+                // try again
+            } else if (n == 0 || errno == EINVAL || errno == ENOSYS
+                       || errno == EXDEV || errno == EOPNOTSUPP
+                       || errno == EBADF || errno == ESPIPE) {
+                ++method;
+                copied = false;
+            } else {
+                return pos ? pos : -1;
+            }
+        }
+        if (!positional) {
+            in->tag = in->end_tag = in->pos_tag;
+        }
+        out->tag = out->end_tag = out->pos_tag;
+        if (out->sparse && io61_sparse_finish(out) < 0) {
+            return pos ? pos : -1;
+        }
+        if (method < 3) {
+            return pos;
+        }
+    }
+
+    // Otherwise, copy through a buffer
+    unsigned char buf[16384];
+    while (pos < sz) {
+        ssize_t r = io61_read(in, buf, std::min(sz - pos, sizeof(buf)));
+        if (r <= 0) {
+            return r < 0 && pos == 0 ? -1 : pos;
+        }
+        ssize_t w = io61_write(out, buf, r);
+        if (w > 0) {
+            pos += w;
+        }
+        if (w != r) {
+            return pos ? pos : -1;
+        }
+    }
+    return pos;
+}
+
+
+// io61_gather_worker(g)
+//    Body of an io61_gather worker thread: claim and read chunks until
+//    every input is divided up.
+
+static void io61_gather_worker(io61_gather_state* g) {
+    std::unique_lock<std::mutex> guard(g->m);
+    while (true) {
+        g->wake_workers.wait(guard, [&] {
+            return g->stop || g->cur == g->nin || g->remaining == 0
+                || (g->next < g->emit + g->bufs.size() && !g->busy);
+        });
+        if (g->stop || g->cur == g->nin || g->remaining == 0) {
+            if (g->cur != g->nin && g->cur_off >= 0) {
+                g->in[g->cur]->pos_tag = g->cur_off;
+            }
+            g->wake_writer.notify_all();
+            return;
+        }
+
+        // Start the current input
+        io61_file* f = g->in[g->cur];
+        if (g->cur_off < 0 && (f->map || !f->slots.empty())) {
+            g->cur_off = f->pos_tag;
+            g->cur_end = std::max(f->map ? (off_t) f->map_size
+                                  : io61_filesize(f), f->pos_tag);
+        }
+        size_t len = std::min(io61_gather_chunk, g->remaining);
+        if (g->cur_off >= 0) {
+            len = std::min(len, (size_t) (g->cur_end - g->cur_off));
+            if (len == 0) {
+                f->pos_tag = g->cur_end;
+                ++g->cur;
+                g->cur_off = -1;
+                continue;
+            }
+        }
+
+        // Claim a chunk
+        size_t seq = g->next;
+        ++g->next;
+        g->remaining -= len;
+        io61_gather_buf& b = g->bufs[seq % g->bufs.size()];
+        off_t off = g->cur_off;
+        if (off >= 0) {
+            g->cur_off += len;
+        } else {
+            g->busy = true;
+        }
+
+        // Read it, by offset or in order
+        guard.unlock();
+        ssize_t n = 0;
+        unsigned reads = 0;
+        if (off >= 0) {
+            while ((size_t) n != len) {
+                ssize_t r = pread(f->fd, &b.buf[n], len - n, off + n);
+                ++reads;
+                if (r > 0) {
+                    n += r;
+                } else if (r == 0 || errno != EINTR) {
+                    n = r < 0 && n == 0 ? -1 : n;
+                    break;
+                }
+            }
+        } else {
+            n = io61_read(f, b.buf, len);
+        }
+        guard.lock();
+
+        if (off >= 0) {
+            f->stats.reads += reads;
+            f->stats.bytes_read += std::max(n, (ssize_t) 0);
+        } else {
+            g->busy = false;
+            g->remaining += len - std::max(n, (ssize_t) 0);
+            if (n <= 0) {
+                ++g->cur;
+            }
+        }
+        b.n = n;
+        b.ready = true;
+        g->wake_writer.notify_all();
+        g->wake_workers.notify_all();
+    }
+}
+
+
+// io61_gather(out, in, nin, sz)
+//    Copy up to `sz` characters from the `nin` read-only files in `in`,
+//    one after another, to the write-only file `out`. Returns the number
+//    of characters copied, or -1 if an error occurred before any were.
+//
+//    Worker threads (see io61_setgather) read ahead into a bounded set
+//    of buffers while the calling thread writes them in order. Different
+//    workers read different inputs, or different regions of one
+//    memory-mapped or block-cached input, at once; pipes and other
+//    streams are read in order. The inputs must not be used by other
+//    threads meanwhile; afterwards, each is positioned after what was
+//    copied from it.
+
+ssize_t io61_gather(io61_file* out, io61_file* const* in, size_t nin,
+                    size_t sz) {
+    for (size_t i = 0; i != nin; ++i) {
+        io61_sync(in[i]);
+        assert(in[i]->mode == O_RDONLY);
+    }
+    io61_gather_state g;
+    g.in = in;
+    g.nin = nin;
+    g.remaining = sz;
+    g.bufs.resize(std::max(gather_config.nbuffers, (size_t) 1));
+    for (auto& b : g.bufs) {
+        b.buf = io61_alloc(io61_gather_chunk);
+    }
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i != std::max(gather_config.nthreads, (size_t) 1); ++i) {
+        workers.emplace_back(io61_gather_worker, &g);
+    }
+
+    // Write chunks in order until the workers run out
+    size_t pos = 0;
+    bool err = false;
+    std::unique_lock<std::mutex> guard(g.m);
+    while (true) {
+        io61_gather_buf& b = g.bufs[g.emit % g.bufs.size()];
+        g.wake_writer.wait(guard, [&] {
+            return b.ready
+                || (g.emit == g.next
+                    && (g.cur == g.nin || g.remaining == 0) && !g.busy);
+        });
+        if (!b.ready) {
+            break;
+        }
+        guard.unlock();
+        ssize_t w = 0;
+        if (b.n > 0) {
+            w = io61_write(out, b.buf, b.n);
+        }
+        guard.lock();
+        if (b.n < 0 || w != b.n) {
+            err = true;
+            g.stop = true;
+        }
+        pos += std::max(w, (ssize_t) 0);
+        b.ready = false;
+        ++g.emit;
+        g.wake_workers.notify_all();
+        if (err) {
+            break;
+        }
+    }
+    guard.unlock();
+
+    for (auto& t : workers) {
+        t.join();
+    }
+    for (auto& b : g.bufs) {
+        free(b.buf);
+    }
+    return err && pos == 0 ? -1 : pos;
+}
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -240,11 +4870,20 @@ int io61_seek(io61_file* f, off_t pos) {
 //    If `!filename`, returns either the standard input or the
 //    standard output, depending on `mode`. Exits with an error message if
 //    `filename != nullptr` and the named file cannot be opened.
+//
+//    `mode` may include O_DIRECT, which bypasses the page cache: io61
+//    then reads whole aligned blocks into aligned buffers, and writes
+//    aligned blocks directly and any unaligned head or tail normally.
+//    Files that can't use O_DIRECT fall back to buffered I/O.
 
 io61_file* io61_open_check(const char* filename, int mode) {
     int fd;
     if (filename) {
         fd = open(filename, mode, 0666);
+        if (fd < 0 && errno == EINVAL && (mode & O_DIRECT)) {
+            // The file system doesn't support O_DIRECT
+            fd = open(filename, mode & ~O_DIRECT, 0666);
+        }
     } else if ((mode & O_ACCMODE) == O_RDONLY) {
         fd = STDIN_FILENO;
     } else {
@@ -263,10 +4902,15 @@ io61_file* io61_open_check(const char* filename, int mode) {
 //    well-defined size (for instance, if it is a pipe).
 
 off_t io61_filesize(io61_file* f) {
+    // A compressed reader's size is that of the data it returns
+    if (f->z) {
+        return f->mode == O_RDONLY ? io61_z_size(f) : -1;
+    }
     struct stat s;
     int r = fstat(f->fd, &s);
     if (r >= 0 && S_ISREG(s.st_mode)) {
-        return s.st_size;
+        // Dirty pages of a read/write file may extend it
+        return std::max(s.st_size, f->mode == O_RDWR ? f->size : 0);
     } else {
         return -1;
     }
@@ -7,6 +7,7 @@
 #include <vector>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 struct io61_file;
 
@@ -15,14 +16,44 @@ io61_file* io61_open_check(const char* filename, int mode);
 int io61_close(io61_file* f);
 
 off_t io61_filesize(io61_file* f);
+int io61_hasholes(io61_file* f);
 
 int io61_seek(io61_file* f, off_t pos);
+int io61_setcache(io61_file* f, size_t nslots, size_t blocksize);
+int io61_setasync(io61_file* f, size_t nbuffers);
+int io61_seturing(io61_file* f, int enable);
+int io61_setbuf(io61_file* f, size_t size);
+int io61_setflush(io61_file* f, int policy, io61_file* pair);
+int io61_setsparse(io61_file* f, int enable);
+int io61_setshared(io61_file* f, int enable);
+int io61_setsize(io61_file* f, off_t size);
+int io61_setcompress(io61_file* f, int enable);
+int io61_advise(io61_file* f, off_t offset, off_t len, int hint);
+void io61_setpool(size_t cap);
+void io61_setgather(size_t nthreads, size_t nbuffers);
 
-int io61_readc(io61_file* f);
-int io61_writec(io61_file* f, int ch);
+// Flush policies (see io61_setflush)
+enum { IO61_FLUSH_THROUGHPUT, IO61_FLUSH_LATENCY, IO61_FLUSH_ADAPTIVE };
+
+// Access hints (see io61_advise)
+enum { IO61_ADVISE_NORMAL, IO61_ADVISE_SEQUENTIAL, IO61_ADVISE_RANDOM,
+       IO61_ADVISE_WILLNEED, IO61_ADVISE_DONTNEED };
+
+int io61_readc_slow(io61_file* f);
+int io61_writec_slow(io61_file* f, int ch);
 
 ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz);
 ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz);
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt);
+ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz, off_t off);
+ssize_t io61_pwrite(io61_file* f, const unsigned char* buf, size_t sz,
+                    off_t off);
+ssize_t io61_getdelim(io61_file* f, const unsigned char** line, int delim);
+ssize_t io61_readline(io61_file* f, const unsigned char** line);
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt);
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t sz);
+ssize_t io61_gather(io61_file* out, io61_file* const* in, size_t nin,
+                    size_t sz);
 
 int io61_flush(io61_file* f);
 
@@ -30,6 +61,79 @@ void io61_profile_begin();
 void io61_profile_end();
 
 
+// io61_stats
+//    I/O counters of one file. An io61 implementation that keeps them
+//    passes them to io61_profile_record when the file is closed, and
+//    io61_profile_end reports them.
+
+struct io61_stats {
+    int fd;
+    int mode;
+    unsigned long long reads;           // read system calls or requests
+    unsigned long long writes;          // write system calls or requests
+    unsigned long long seeks;           // lseek system calls
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long long hits;            // reads served from cached data;
+                                        // each io61_readc counts
+    unsigned long long refills;         // reads that went to the file
+    unsigned long long flushes;         // flushes of buffered output,
+                                        // including io61's own
+};
+
+void io61_profile_record(const io61_stats* s);
+
+
+// io61_cursor
+//    The only public part of an io61_file, which must begin with one
+//    (see io61_cursor_of).
+//    While `rpos != rend`, the next character to read is at `rpos`; while
+//    `wpos != wend`, the next character written goes to `wpos`. The
+//    implementation sets these up, and an io61_file whose cursor is
+//    all null always takes the out-of-line path.
+
+struct io61_cursor {
+    unsigned char* rpos;
+    unsigned char* rend;
+    unsigned char* wpos;
+    unsigned char* wend;
+};
+
+
+// io61_cursor_of(f)
+//    Return the cursor of `f`. io61_file is incomplete here, so this
+//    casts: every implementation makes its io61_file standard-layout
+//    with an io61_cursor as its first member, and checks both with a
+//    static_assert, so the two pointers are interconvertible.
+
+inline io61_cursor* io61_cursor_of(io61_file* f) {
+    return reinterpret_cast<io61_cursor*>(f);
+}
+
+
+// io61_readc(f), io61_writec(f, ch)
+//    Inline fast paths: read or write a character at the cursor, like
+//    getc_unlocked. Everything else, including refills and flushes, is
+//    done by io61_readc_slow and io61_writec_slow.
+
+inline int io61_readc(io61_file* f) {
+    io61_cursor* c = io61_cursor_of(f);
+    if (c->rpos != c->rend) {
+        return *c->rpos++;
+    }
+    return io61_readc_slow(f);
+}
+
+inline int io61_writec(io61_file* f, int ch) {
+    io61_cursor* c = io61_cursor_of(f);
+    if (c->wpos != c->wend) {
+        *c->wpos++ = ch;
+        return 0;
+    }
+    return io61_writec_slow(f, ch);
+}
+
+
 struct io61_arguments {
     size_t input_size;          // `-s` option: input size. Default SIZE_MAX
     size_t block_size;          // `-b` option: block size. Default 0
@@ -0,0 +1,38 @@
+#include "io61.hh"
+#include <algorithm>
+
+// Usage: ./linerev61 [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE a line at a time, reversing the
+//    characters of each line (but not its newline), like rev(1).
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args(argc, argv, "o:i:");
+
+    // Open files
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    // Copy lines; `line` points into io61's buffer, so reverse a copy
+    std::vector<unsigned char> buf;
+    const unsigned char* line;
+    while (true) {
+        ssize_t amount = io61_readline(inf, &line);
+        if (amount <= 0) {
+            break;
+        }
+        size_t len = amount;
+        if (line[len - 1] == '\n') {
+            --len;
+        }
+        buf.assign(line, line + amount);
+        std::reverse(buf.begin(), buf.begin() + len);
+        io61_write(outf, buf.data(), amount);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+}
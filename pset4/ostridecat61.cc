@@ -24,12 +24,19 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
-    io61_file* outf = io61_open_check(args.output_file,
-                                      O_WRONLY | O_CREAT | O_TRUNC);
+    // Open the output for reading too if we can, so io61_setsize can
+    // map it
+    int outfd = args.output_file
+        ? open(args.output_file, O_RDWR | O_CREAT | O_TRUNC, 0666) : -1;
+    io61_file* outf = outfd >= 0
+        ? io61_fdopen(outfd, O_WRONLY)
+        : io61_open_check(args.output_file, O_WRONLY | O_CREAT | O_TRUNC);
     if (io61_seek(outf, 0) < 0) {
         fprintf(stderr, "ostridecat61: output file is not seekable\n");
         exit(1);
     }
+    // The output is as big as the input, so it can be mapped
+    io61_setsize(outf, args.input_size);
 
     // Copy file data
     size_t pos = 0, written = 0;
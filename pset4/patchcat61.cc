@@ -0,0 +1,71 @@
+#include "io61.hh"
+#include <algorithm>
+
+// Usage: ./patchcat61 [-b BLOCKSIZE] [-r RANDOMSEED] -o OUTFILE [FILE]
+//    Copies the input FILE to OUTFILE, then patches OUTFILE in place:
+//    it visits OUTFILE's blocks in random order, reading each one back
+//    and rewriting it reversed. OUTFILE is opened read/write, so every
+//    read follows writes to the same file. Default BLOCKSIZE is 4096.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    srandom(83419);
+    io61_arguments args(argc, argv, "b:r:o:i:");
+    size_t block_size = args.block_size ? args.block_size : 4096;
+    if (!args.output_file) {
+        fprintf(stderr, "patchcat61: need an output file\n");
+        exit(1);
+    }
+
+    // Allocate buffer, open files
+    unsigned char* buf = new unsigned char[block_size];
+
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_RDWR | O_CREAT | O_TRUNC);
+
+    // Copy file data
+    size_t size = 0;
+    while (true) {
+        ssize_t amount = io61_read(inf, buf, block_size);
+        if (amount <= 0) {
+            break;
+        }
+        io61_write(outf, buf, amount);
+        size += amount;
+    }
+
+    // Calculate random permutation of the output's blocks
+    size_t nblocks = (size + block_size - 1) / block_size;
+    size_t* blockpos = new size_t[nblocks];
+    for (size_t i = 0; i < nblocks; ++i) {
+        blockpos[i] = i;
+    }
+    for (size_t n = nblocks; n != 0; --n) {
+        std::swap(blockpos[random() % n], blockpos[n - 1]);
+    }
+
+    // Reverse each block in place
+    for (size_t i = 0; i < nblocks; ++i) {
+        size_t pos = blockpos[i] * block_size;
+        if (io61_seek(outf, pos) < 0) {
+            fprintf(stderr, "patchcat61: output file is not seekable\n");
+            exit(1);
+        }
+        ssize_t amount = io61_read(outf, buf, block_size);
+        if (amount <= 0) {
+            fprintf(stderr, "patchcat61: lost block at %zu\n", pos);
+            exit(1);
+        }
+        std::reverse(buf, buf + amount);
+        io61_seek(outf, pos);
+        io61_write(outf, buf, amount);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+    delete[] buf;
+    delete[] blockpos;
+}
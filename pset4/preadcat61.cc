@@ -0,0 +1,85 @@
+#include "io61.hh"
+#include <atomic>
+#include <cerrno>
+#include <thread>
+
+// Usage: ./preadcat61 [-b BLOCKSIZE] [-r RANDOMSEED] -o OUTFILE [FILE]
+//    Copies the input FILE to OUTFILE with several threads sharing both
+//    files through positioned I/O (see io61_pread). The threads take
+//    blocks in random order; each reads its block with io61_pread and
+//    writes it with io61_pwrite, so neither file position moves. FILE is
+//    read through a small block cache, not a memory mapping, so the
+//    threads miss and evict blocks at once; OUTFILE is mapped if it can
+//    be (see io61_setsize). Default BLOCKSIZE is 4096.
+
+static constexpr size_t nthreads = 4;
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    srandom(83419);
+    io61_arguments args(argc, argv, "b:r:o:i:");
+    size_t block_size = args.block_size ? args.block_size : 4096;
+    if (!args.output_file) {
+        fprintf(stderr, "preadcat61: need an output file\n");
+        exit(1);
+    }
+
+    // Open files, measure file sizes
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    off_t size = io61_filesize(inf);
+    if (size < 0) {
+        fprintf(stderr, "preadcat61: can't get size of input file\n");
+        exit(1);
+    }
+    io61_setcache(inf, 32, 4096);
+
+    // Open the output for reading too, so io61_setsize can map it
+    int outfd = open(args.output_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (outfd < 0) {
+        fprintf(stderr, "%s: %s\n", args.output_file, strerror(errno));
+        exit(1);
+    }
+    io61_file* outf = io61_fdopen(outfd, O_WRONLY);
+    io61_setsize(outf, size);
+
+    // Calculate random permutation of file's blocks
+    size_t nblocks = (size + block_size - 1) / block_size;
+    std::vector<size_t> blockpos(nblocks);
+    for (size_t i = 0; i < nblocks; ++i) {
+        blockpos[i] = i;
+    }
+    for (size_t n = nblocks; n != 0; --n) {
+        std::swap(blockpos[random() % n], blockpos[n - 1]);
+    }
+
+    // Copy blocks from several threads
+    std::atomic<size_t> next_block(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t != nthreads; ++t) {
+        threads.emplace_back([&] () {
+            std::vector<unsigned char> buf(block_size);
+            size_t i;
+            while ((i = next_block++) < nblocks) {
+                off_t pos = blockpos[i] * block_size;
+                ssize_t amount = io61_pread(inf, buf.data(), block_size, pos);
+                if (amount <= 0
+                    || io61_pwrite(outf, buf.data(), amount, pos) != amount) {
+                    failed = true;
+                }
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    if (failed) {
+        fprintf(stderr, "preadcat61: positioned I/O failed\n");
+        exit(1);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+}
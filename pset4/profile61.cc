@@ -2,6 +2,8 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <cerrno>
+#include <string>
+#include <mutex>
 
 // profile61.c
 //    The profile functions measure how much time and memory are used
@@ -10,6 +12,29 @@
 //    parses common arguments into a structure.
 
 static struct timeval tv_begin;
+static std::vector<io61_stats> closed_stats;
+static std::mutex closed_stats_lock;    // files may close on any thread
+
+
+// io61_profile_record(s)
+//    Remember the I/O counters of a closed file for io61_profile_end.
+
+void io61_profile_record(const io61_stats* s) {
+    std::lock_guard<std::mutex> guard(closed_stats_lock);
+    closed_stats.push_back(*s);
+}
+
+
+// io61_stats_json(s)
+//    Return the counters in `s` as JSON members.
+
+static std::string io61_stats_json(const io61_stats& s) {
+    char buf[500];
+    sprintf(buf, "\"reads\":%llu, \"writes\":%llu, \"seeks\":%llu, \"bytes_read\":%llu, \"bytes_written\":%llu, \"hits\":%llu, \"refills\":%llu, \"flushes\":%llu",
+            s.reads, s.writes, s.seeks, s.bytes_read, s.bytes_written,
+            s.hits, s.refills, s.flushes);
+    return buf;
+}
 
 void io61_profile_begin() {
     int r = gettimeofday(&tv_begin, 0);
@@ -32,11 +57,34 @@ void io61_profile_end() {
     timeradd(&usage.ru_stime, &cusage.ru_stime, &usage.ru_stime);
 
     char buf[1000];
-    int len = sprintf(buf, "{\"time\":%ld.%06ld, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld}\n",
-                      tv_end.tv_sec, (long) tv_end.tv_usec,
-                      usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
-                      usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
-                      usage.ru_maxrss + cusage.ru_maxrss);
+    sprintf(buf, "{\"time\":%ld.%06ld, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld",
+            tv_end.tv_sec, (long) tv_end.tv_usec,
+            usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
+            usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
+            usage.ru_maxrss + cusage.ru_maxrss);
+    std::string report = buf;
+
+    // Add the I/O counters of closed files, in total and per file
+    if (!closed_stats.empty()) {
+        io61_stats total = {};
+        std::string files;
+        for (auto& s : closed_stats) {
+            total.reads += s.reads;
+            total.writes += s.writes;
+            total.seeks += s.seeks;
+            total.bytes_read += s.bytes_read;
+            total.bytes_written += s.bytes_written;
+            total.hits += s.hits;
+            total.refills += s.refills;
+            total.flushes += s.flushes;
+            sprintf(buf, "%s{\"fd\":%d, \"mode\":\"%s\", ",
+                    files.empty() ? "" : ", ", s.fd,
+                    s.mode == O_RDONLY ? "r" : s.mode == O_WRONLY ? "w" : "rw");
+            files += buf + io61_stats_json(s) + "}";
+        }
+        report += ", \"io\":{" + io61_stats_json(total) + "}, \"files\":[" + files + "]";
+    }
+    report += "}\n";
 
     // Print the report to file descriptor 100 if it's available. Our
     // `check.pl` test harness uses this file descriptor.
@@ -45,8 +93,8 @@ void io61_profile_end() {
     if (fd == STDERR_FILENO) {
         fflush(stderr);
     }
-    ssize_t nwritten = write(fd, buf, len);
-    assert(nwritten == len);
+    ssize_t nwritten = write(fd, report.data(), report.size());
+    assert(nwritten == (ssize_t) report.size());
 }
 
 
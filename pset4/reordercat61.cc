@@ -30,8 +30,13 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
-    io61_file* outf = io61_open_check(args.output_file,
-                                      O_WRONLY | O_CREAT | O_TRUNC);
+    // Open the output for reading too if we can, so io61_setsize can
+    // map it
+    int outfd = args.output_file
+        ? open(args.output_file, O_RDWR | O_CREAT | O_TRUNC, 0666) : -1;
+    io61_file* outf = outfd >= 0
+        ? io61_fdopen(outfd, O_WRONLY)
+        : io61_open_check(args.output_file, O_WRONLY | O_CREAT | O_TRUNC);
     if (io61_seek(outf, 0) < 0) {
         fprintf(stderr, "reordercat61: output file is not seekable\n");
         exit(1);
@@ -51,14 +56,32 @@ int main(int argc, char* argv[]) {
     for (size_t i = 0; i < nblocks; ++i) {
         blockpos[i] = i;
     }
+    // Blocks are transferred from the end of `blockpos` back
+    for (size_t n = nblocks; n != 0; --n) {
+        std::swap(blockpos[random() % n], blockpos[n - 1]);
+    }
+
+    // The order is known in advance, so tell io61 which blocks come
+    // next, `lookahead` blocks ahead
+    const size_t lookahead = 32;
+    io61_advise(inf, 0, 0, IO61_ADVISE_RANDOM);
+    for (size_t i = 0; i < lookahead && i < nblocks; ++i) {
+        io61_advise(inf, blockpos[nblocks - 1 - i] * block_size, block_size,
+                    IO61_ADVISE_WILLNEED);
+    }
+
+    // The output is as big as the input, so it can be mapped
+    io61_setsize(outf, args.input_size);
 
     // Copy file data
     while (nblocks != 0) {
         // Choose block to read
-        size_t index = random() % nblocks;
-        size_t pos = blockpos[index] * block_size;
-        blockpos[index] = blockpos[nblocks - 1];
         --nblocks;
+        size_t pos = blockpos[nblocks] * block_size;
+        if (nblocks >= lookahead) {
+            io61_advise(inf, blockpos[nblocks - lookahead] * block_size,
+                        block_size, IO61_ADVISE_WILLNEED);
+        }
 
         // Transfer that block
         io61_seek(inf, pos);
@@ -0,0 +1,109 @@
+#include "io61.hh"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// Usage: ./sharedcat61 [-b BLOCKSIZE] -o OUTFILE [FILE]
+//    Copies the input FILE to OUTFILE with several threads sharing one
+//    thread-safe output stream (see io61_setshared). The threads take
+//    blocks of the input in turn and each writes its blocks as records
+//    tagged with the block number, so records land in whatever order the
+//    threads run. Then OUTFILE is read back and rewritten with the
+//    blocks in order, which makes it a copy of FILE only if no record
+//    was lost or torn. Default BLOCKSIZE is 4096.
+
+static constexpr size_t nthreads = 4;
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args(argc, argv, "b:o:i:");
+    size_t block_size = args.block_size ? args.block_size : 4096;
+    if (!args.output_file) {
+        fprintf(stderr, "sharedcat61: need an output file\n");
+        exit(1);
+    }
+
+    // Read the input
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    std::vector<unsigned char> in;
+    while (true) {
+        size_t pos = in.size();
+        in.resize(pos + 65536);
+        ssize_t amount = io61_read(inf, &in[pos], 65536);
+        in.resize(pos + (amount > 0 ? amount : 0));
+        if (amount <= 0) {
+            break;
+        }
+    }
+    io61_close(inf);
+
+    // Write records from several threads. A file that can't be shared
+    // needs a lock.
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    bool shared = io61_setshared(outf, 1) == 0;
+    std::mutex m;
+    size_t nblocks = (in.size() + block_size - 1) / block_size;
+    std::atomic<size_t> next_block(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t != nthreads; ++t) {
+        threads.emplace_back([&] () {
+            std::vector<unsigned char> rec(block_size + 64);
+            size_t b;
+            while ((b = next_block++) < nblocks) {
+                size_t len = std::min(block_size, in.size() - b * block_size);
+                int hlen = snprintf((char*) rec.data(), 64, "%zu %zu\n",
+                                    b, len);
+                memcpy(&rec[hlen], &in[b * block_size], len);
+                std::unique_lock<std::mutex> guard(m, std::defer_lock);
+                if (!shared) {
+                    guard.lock();
+                }
+                io61_write(outf, rec.data(), hlen + len);
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    io61_close(outf);
+
+    // Read the records back and put their blocks in order
+    inf = io61_open_check(args.output_file, O_RDONLY);
+    std::vector<unsigned char> recs(in.size() + nblocks * 64);
+    size_t nrecs = std::max(io61_read(inf, recs.data(), recs.size()),
+                            (ssize_t) 0);
+    io61_close(inf);
+    std::vector<const unsigned char*> blocks(nblocks, nullptr);
+    size_t pos = 0;
+    while (pos < nrecs) {
+        const unsigned char* nl = (const unsigned char*)
+            memchr(&recs[pos], '\n', std::min(nrecs - pos, (size_t) 64));
+        char* end;
+        size_t b = strtoul((const char*) &recs[pos], &end, 10);
+        size_t len = *end == ' ' ? strtoul(end + 1, &end, 10) : 0;
+        if (!nl
+            || end != (const char*) nl
+            || b >= nblocks || blocks[b]
+            || nl + 1 + len > &recs[nrecs]) {
+            fprintf(stderr, "sharedcat61: bad record at %zu\n", pos);
+            exit(1);
+        }
+        blocks[b] = nl + 1;
+        pos = nl + 1 + len - recs.data();
+    }
+
+    outf = io61_open_check(args.output_file, O_WRONLY | O_CREAT | O_TRUNC);
+    for (size_t b = 0; b != nblocks; ++b) {
+        if (!blocks[b]) {
+            fprintf(stderr, "sharedcat61: lost block %zu\n", b);
+            exit(1);
+        }
+        io61_write(outf, blocks[b],
+                   std::min(block_size, in.size() - b * block_size));
+    }
+    io61_close(outf);
+    io61_profile_end();
+}
@@ -2,6 +2,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <climits>
+#include <cstddef>
+#include <type_traits>
 #include <cerrno>
 
 // stdio-io61.c
@@ -12,19 +14,32 @@
 //    Data structure for io61 file wrappers.
 
 struct io61_file {
+    io61_cursor cur = {};       // always null: no inline fast path
     FILE* f;
+    char* line = nullptr;       // last line read by io61_getdelim
+    size_t linecap = 0;
 };
 
+static_assert(std::is_standard_layout<io61_file>::value
+              && offsetof(io61_file, cur) == 0,
+              "io61_cursor_of needs the cursor at offset 0");
+
 
 // io61_fdopen(fd, mode)
 //    Return a new io61_file for file descriptor `fd`. `mode` is
-//    either O_RDONLY for a read-only file or O_WRONLY for a
-//    write-only file. You need not support read/write files.
+//    O_RDONLY for a read-only file, O_WRONLY for a write-only file, or
+//    O_RDWR for a read/write file.
 
 io61_file* io61_fdopen(int fd, int mode) {
     assert(fd >= 0);
     io61_file* f = new io61_file;
-    f->f = fdopen(fd, mode == O_RDONLY ? "r" : "w");
+    const char* stdio_mode = "w";
+    if (mode == O_RDONLY) {
+        stdio_mode = "r";
+    } else if (mode == O_RDWR) {
+        stdio_mode = "r+";
+    }
+    f->f = fdopen(fd, stdio_mode);
     return f;
 }
 
@@ -35,16 +50,17 @@ io61_file* io61_fdopen(int fd, int mode) {
 int io61_close(io61_file* f) {
     io61_flush(f);
     int r = fclose(f->f);
+    free(f->line);
     delete f;
     return r;
 }
 
 
-// io61_readc(f)
+// io61_readc_slow(f)
 //    Read a single (unsigned) character from `f` and return it. Returns EOF
 //    (which is -1) on error or end-of-file.
 
-int io61_readc(io61_file* f) {
+int io61_readc_slow(io61_file* f) {
     return fgetc(f->f);
 }
 
@@ -66,11 +82,36 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
 }
 
 
-// io61_writec(f)
+// io61_getdelim(f, line, delim)
+//    Read a line ending in the character `delim` from `f`. Sets `*line`
+//    to the line's characters and returns its length, including the
+//    delimiter. Returns 0 at end of file, or -1 on error. `*line` stays
+//    valid until the next call on `f`. This version uses getdelim(3).
+
+ssize_t io61_getdelim(io61_file* f, const unsigned char** line, int delim) {
+    ssize_t n = getdelim(&f->line, &f->linecap, delim, f->f);
+    if (n < 0) {
+        return ferror(f->f) ? -1 : 0;
+    }
+    *line = (const unsigned char*) f->line;
+    return n;
+}
+
+
+// io61_readline(f, line)
+//    Read a line ending in '\n' from `f`. Same as
+//    `io61_getdelim(f, line, '\n')`.
+
+ssize_t io61_readline(io61_file* f, const unsigned char** line) {
+    return io61_getdelim(f, line, '\n');
+}
+
+
+// io61_writec_slow(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
 //    -1 on error.
 
-int io61_writec(io61_file* f, int ch) {
+int io61_writec_slow(io61_file* f, int ch) {
     return fputc(ch, f->f);
 }
 
@@ -90,6 +131,21 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
 }
 
 
+// io61_pread(f, buf, sz, off), io61_pwrite(f, buf, sz, off)
+//    Read or write up to `sz` characters at file offset `off` of `f`,
+//    without moving its file position. This version calls pread(2) and
+//    pwrite(2), which any number of threads may do at once.
+
+ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz, off_t off) {
+    return pread(fileno(f->f), buf, sz, off);
+}
+
+ssize_t io61_pwrite(io61_file* f, const unsigned char* buf, size_t sz,
+                    off_t off) {
+    return pwrite(fileno(f->f), buf, sz, off);
+}
+
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
@@ -109,6 +165,100 @@ int io61_seek(io61_file* f, off_t pos) {
 }
 
 
+// io61_setcache(f, nslots, blocksize)
+//    Configure the block cache of `f`. This version has none, and
+//    returns -1.
+
+int io61_setcache(io61_file* f, size_t nslots, size_t blocksize) {
+    (void) f, (void) nslots, (void) blocksize;
+    return -1;
+}
+
+
+// io61_setsize(f, size)
+//    Declare that the output of `f` will be `size` bytes long. This
+//    version doesn't use the size, and returns -1.
+
+int io61_setsize(io61_file* f, off_t size) {
+    (void) f, (void) size;
+    return -1;
+}
+
+
+// io61_setsparse(f, enable)
+//    Turn hole-preserving writes on or off for `f`. This version always
+//    writes every block, and returns -1.
+
+int io61_setsparse(io61_file* f, int enable) {
+    (void) f, (void) enable;
+    return -1;
+}
+
+
+// io61_hasholes(f)
+//    Return 1 if `f` has holes. This version doesn't look, and returns 0.
+
+int io61_hasholes(io61_file* f) {
+    (void) f;
+    return 0;
+}
+
+
+// io61_setshared(f, enable)
+//    Let several threads write to `f` at once. stdio locks the stream for
+//    every call already, so this version returns 0.
+
+int io61_setshared(io61_file* f, int enable) {
+    (void) f, (void) enable;
+    return 0;
+}
+
+
+// io61_setcompress(f, enable)
+//    Put `f` in compressed mode. This version stores characters as
+//    they are, and returns -1.
+
+int io61_setcompress(io61_file* f, int enable) {
+    (void) f, (void) enable;
+    return -1;
+}
+
+
+// io61_advise(f, offset, len, hint)
+//    Tell io61 how `f` will be read. This version ignores the hint,
+//    and returns -1.
+
+int io61_advise(io61_file* f, off_t offset, off_t len, int hint) {
+    (void) f, (void) offset, (void) len, (void) hint;
+    return -1;
+}
+
+
+// io61_gather(out, in, nin, sz)
+//    Copy up to `sz` characters from the `nin` files in `in`, one after
+//    another, to `out`. Returns the number of characters copied, or -1
+//    if an error occurred before any were.
+
+ssize_t io61_gather(io61_file* out, io61_file* const* in, size_t nin,
+                    size_t sz) {
+    unsigned char buf[8192];
+    size_t pos = 0;
+    for (size_t i = 0; i != nin && pos != sz; ++i) {
+        while (pos != sz) {
+            size_t n = sz - pos < sizeof(buf) ? sz - pos : sizeof(buf);
+            ssize_t r = io61_read(in[i], buf, n);
+            if (r == 0) {
+                break;
+            } else if (r < 0 || io61_write(out, buf, r) != r) {
+                return pos ? pos : -1;
+            }
+            pos += r;
+        }
+    }
+    return pos;
+}
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -31,6 +31,9 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
+    // Each pass over the strides touches every part of the input
+    io61_advise(inf, 0, args.input_size, IO61_ADVISE_WILLNEED);
+
     io61_file* outf = io61_open_check(args.output_file,
                                       O_WRONLY | O_CREAT | O_TRUNC);
 
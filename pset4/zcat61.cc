@@ -0,0 +1,76 @@
+#include "io61.hh"
+#include <string>
+
+// Usage: ./zcat61 [-b BLOCKSIZE] -o OUTFILE [FILE]
+//    Compresses the input FILE into a temporary file, OUTFILE.z (see
+//    io61_setcompress). Then reads the compressed file back from the
+//    last block to the first, seeking before every block, and writes
+//    the blocks to OUTFILE at their original positions, so OUTFILE
+//    should be a copy of FILE. Default BLOCKSIZE is 4096.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args(argc, argv, "b:o:i:");
+    size_t block_size = args.block_size ? args.block_size : 4096;
+    if (!args.output_file) {
+        fprintf(stderr, "zcat61: need an output file\n");
+        exit(1);
+    }
+    std::string zfile = std::string(args.output_file) + ".z";
+
+    // Allocate buffer, open files
+    unsigned char* buf = new unsigned char[block_size];
+
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* zf = io61_open_check(zfile.c_str(),
+                                    O_WRONLY | O_CREAT | O_TRUNC);
+    io61_setcompress(zf, 1);
+
+    // Compress file data
+    size_t size = 0;
+    while (true) {
+        ssize_t amount = io61_read(inf, buf, block_size);
+        if (amount <= 0) {
+            break;
+        }
+        io61_write(zf, buf, amount);
+        size += amount;
+    }
+    io61_close(inf);
+    io61_close(zf);
+
+    // Open the compressed file for reading
+    zf = io61_open_check(zfile.c_str(), O_RDONLY);
+    io61_setcompress(zf, 1);
+    if (io61_filesize(zf) != (off_t) size) {
+        fprintf(stderr, "zcat61: compressed file has size %zd, expected %zu\n",
+                (ssize_t) io61_filesize(zf), size);
+        exit(1);
+    }
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    // Decompress file data in reverse block order
+    size_t nblocks = (size + block_size - 1) / block_size;
+    while (nblocks != 0) {
+        --nblocks;
+        size_t pos = nblocks * block_size;
+        if (io61_seek(zf, pos) < 0 || io61_seek(outf, pos) < 0) {
+            fprintf(stderr, "zcat61: files are not seekable\n");
+            exit(1);
+        }
+        ssize_t amount = io61_read(zf, buf, block_size);
+        if (amount <= 0) {
+            fprintf(stderr, "zcat61: lost block at %zu\n", pos);
+            exit(1);
+        }
+        io61_write(outf, buf, amount);
+    }
+
+    io61_close(zf);
+    io61_close(outf);
+    io61_profile_end();
+    unlink(zfile.c_str());
+    delete[] buf;
+}